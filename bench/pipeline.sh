@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+# pipeline.sh - Time builtin pipelines as threads of one child and as a process per stage
+#
+# usage: bench/pipeline.sh [path/to/tsh]
+#
+# Builds tsh from tinyShell.c into a temporary directory unless a binary
+# is given. Each way (set -o pipethreads, the default, then set +o
+# pipethreads) one tsh runs:
+#   - $TSH_PIPE_RUNS (default 2000) printf '%s\n' a b c d e f g h | wc -l
+#     pipelines, for what starting one costs (one fork for the threaded
+#     way, two otherwise);
+#   - $TSH_PIPE_LOOPS (default 10) cat FILE | wc -l over a
+#     $TSH_PIPE_MB (default 64) megabyte file, for bytes per second
+#     through the ring or the pipe. (A line is at most 1022 bytes, so
+#     printf can't make that much by itself.)
+
+runs=${TSH_PIPE_RUNS:-2000}
+loops=${TSH_PIPE_LOOPS:-10}
+mb=${TSH_PIPE_MB:-64}
+dir=$(cd "$(dirname "$0")/.." && pwd)
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+tsh=$1
+if [ -z "$tsh" ]; then
+	tsh=$tmp/tsh
+	${CC:-gcc} -O2 -pthread "$dir/tinyShell.c" -o "$tsh" || exit 1
+fi
+
+yes 'the quick brown fox jumps over the lazy dog' | head -c $((mb << 20)) > "$tmp/text"
+lines=$(wc -l < "$tmp/text")
+
+# script MODE COUNT LINE - a tsh script that runs LINE COUNT times
+script() {
+	echo "set $1 pipethreads"
+	i=0
+	while [ $i -lt "$2" ]; do
+		printf '%s\n' "$3"
+		i=$((i + 1))
+	done
+}
+
+# timed NAME WANT - run $tmp/script in tsh, check its first line of output is WANT; sets ns
+timed() {
+	t0=$(date +%s%N)
+	"$tsh" -p < "$tmp/script" > "$tmp/out" || exit 1
+	ns=$(($(date +%s%N) - t0))
+	if [ "$(sed -n 1p "$tmp/out")" != "$2" ]; then
+		echo "pipeline: $1 printed $(sed -n 1p "$tmp/out"), not $2" >&2
+		exit 1
+	fi
+}
+
+for mode in -o +o; do
+	name=threads
+	[ $mode = +o ] && name=processes
+
+	script $mode "$runs" "printf '%s\\n' a b c d e f g h | wc -l" > "$tmp/script"
+	timed "printf | wc -l" 8
+	echo "$name: printf | wc -l: $((ns / runs / 1000))us per pipeline"
+
+	script $mode "$loops" "cat $tmp/text | wc -l" > "$tmp/script"
+	timed "cat | wc -l" "$lines"
+	echo "$name: cat | wc -l: $((mb * loops * 1000000000 / ns)) MB/s"
+done
@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# startup.sh - Check that tsh -c /bin/true starts fast enough for scripted use
+#
+# usage: bench/startup.sh [path/to/tsh]
+#
+# Builds tsh from tinyShell.c into a temporary directory unless a binary
+# is given, then times "tsh -c /bin/true" against a bare /bin/true with tsh's
+# own bench builtin (one posix_spawn and wait4 per run, no extra shell
+# in between). What the machine takes to start a process is not tsh's,
+# and that run starts two (tsh, then its /bin/true), so the budget is for
+# the rest: it fails if tsh's median is over twice /bin/true's by more
+# than $TSH_STARTUP_BUDGET_US microseconds (default 500). $TSH_STARTUP_RUNS runs of each are timed (default 500) after 50
+# warmups. -c never reads ~/.tshrc, so the rc file costs nothing here.
+# tsh does no $PATH lookup, so the command is a full path; a run that
+# exits non-zero fails the check, since it timed an error path instead.
+
+budget=${TSH_STARTUP_BUDGET_US:-500}
+runs=${TSH_STARTUP_RUNS:-500}
+dir=$(cd "$(dirname "$0")/.." && pwd)
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+tsh=$1
+if [ -z "$tsh" ]; then
+	tsh=$tmp/tsh
+	${CC:-gcc} -O2 -pthread "$dir/tinyShell.c" -o "$tsh" || exit 1
+fi
+case $tsh in
+	/*) ;;
+	*) tsh=$(pwd)/$tsh ;;
+esac
+
+# bench needs a path, not a name to look up in $PATH
+"$tsh" -p -c "bench -n $runs -w 50 --json $tmp/startup.json /bin/true '$tsh -c /bin/true'" || exit 1
+# one result per line, in the order given
+base=$(sed -n 's/.*"median_ns": \([0-9]*\).*/\1/p' "$tmp/startup.json" | sed -n 1p)
+median=$(sed -n 's/.*"median_ns": \([0-9]*\).*/\1/p' "$tmp/startup.json" | sed -n 2p)
+if [ -z "$base" ] || [ -z "$median" ]; then
+	echo "startup: no result from bench" >&2
+	exit 1
+fi
+if sed -n 's/.*"nonzero": \([0-9]*\).*/\1/p' "$tmp/startup.json" | grep -qv '^0$'; then
+	echo "startup: FAIL, a timed command exited non-zero" >&2
+	exit 1
+fi
+
+over_us=$(((median - 2 * base) / 1000))
+if [ "$over_us" -gt "$budget" ]; then
+	echo "startup: FAIL, tsh -c /bin/true takes ${over_us}us over two /bin/true, budget ${budget}us"
+	exit 1
+fi
+echo "startup: ok, tsh -c /bin/true takes ${over_us}us over two /bin/true (budget ${budget}us)"
@@ -0,0 +1,170 @@
+/*
+ * fuzz_parse.c - Fuzz tsh's command line parsing, with a time budget
+ *
+ * Feeds each input to tsh_fuzz_parse() (parseline, parse_launch_opts,
+ * split_pipeline, env_words, parse_redir) from a TSH_LIBRARY build of
+ * tinyShell.c. Besides crashes and sanitizer reports, an input whose
+ * parse takes longer than a budget linear in its length aborts, so a
+ * quadratic path shows up as a crash with the input saved:
+ *
+ *     budget = TSH_FUZZ_BASE_NS + length * TSH_FUZZ_NS_PER_BYTE
+ *
+ * (defaults 200000 and 2000, loose enough for sanitizer builds). A slow
+ * parse is retried and the fastest of the tries counts, so a preempted
+ * run doesn't trip it.
+ *
+ * libFuzzer:
+ *     clang -g -O1 -fsanitize=fuzzer,address -DTSH_LIBRARY -DTSH_FUZZ -DTSH_LIBFUZZER \
+ *         -pthread tinyShell.c fuzz/fuzz_parse.c -o fuzz_parse
+ *     ./fuzz_parse -max_len=4096 fuzz/corpus
+ *
+ * AFL (reads the file named on the command line):
+ *     afl-clang-fast -O1 -DTSH_LIBRARY -DTSH_FUZZ -pthread tinyShell.c fuzz/fuzz_parse.c -o fuzz_parse
+ *     afl-fuzz -i fuzz/corpus -o findings -- ./fuzz_parse @@
+ *
+ * Without either, a gcc build replays the corpus and then tries random
+ * mutations of it (-n rounds, default 0):
+ *     gcc -O1 -g -fsanitize=address -DTSH_LIBRARY -DTSH_FUZZ -pthread tinyShell.c \
+ *         fuzz/fuzz_parse.c -o fuzz_parse
+ *     ./fuzz_parse -n 100000 fuzz/corpus/[a-z]*
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define MAXINPUT (16 << 10)	/* longer inputs are cut; parseline rejects past 1022 anyway */
+#define RETRIES  3			/* tries an over-budget parse gets before it counts */
+
+int tsh_fuzz_parse(const char *cmdline);
+
+static long long base_ns = 200000, per_byte_ns = 2000;
+
+/* parse_ns - Time one tsh_fuzz_parse of line */
+static long long parse_ns(const char *line)
+{
+	struct timespec t0, t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	tsh_fuzz_parse(line);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec);
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+	char *s;
+
+	(void)argc;
+	(void)argv;
+	if ((s = getenv("TSH_FUZZ_BASE_NS")) != NULL)
+		base_ns = atoll(s);
+	if ((s = getenv("TSH_FUZZ_NS_PER_BYTE")) != NULL)
+		per_byte_ns = atoll(s);
+	//the parser's error messages go to stdout; keep them out of the fuzzer's output
+	if (freopen("/dev/null", "w", stdout) == NULL)
+		perror("/dev/null");
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	static char line[MAXINPUT + 1];
+	long long ns, best, budget;
+	int i;
+
+	size = size < MAXINPUT ? size : MAXINPUT;
+	memcpy(line, data, size);
+	line[size] = '\0';
+
+	budget = base_ns + (long long)size * per_byte_ns;
+	best = parse_ns(line);
+	for (i = 1; i < RETRIES && best > budget; i++) {
+		ns = parse_ns(line);
+		best = ns < best ? ns : best;
+	}
+	if (best > budget) {
+		fprintf(stderr, "fuzz_parse: %zu-byte input took %lldns, budget %lldns\n", size, best, budget);
+		abort();
+	}
+	return 0;
+}
+
+#ifndef TSH_LIBFUZZER
+/* mutate - Change buf (len bytes, room for cap) the way a fuzzer might */
+static size_t mutate(char *buf, size_t len, size_t cap)
+{
+	static const char *tokens[] = {" ", "|", "'", "&", "@", "=", ">", ">>", "<", ">&", "2>&1", "3>&-",
+		"@rlimit=", "@dedup", "@env=clean", "@group=", "cpu:", ",", ":", "X=1", "\n", NULL};
+	const char *t;
+	size_t i, n, tl, at = len ? (size_t)rand() % len : 0;
+
+	switch (rand() % 4) {
+	case 0:		/* flip a byte */
+		if (len)
+			buf[at] = rand() % 256 ? rand() % 256 : ' ';
+		break;
+	case 1:		/* drop a run */
+		n = len - at < 8 ? len - at : (size_t)rand() % 8;
+		memmove(buf + at, buf + at + n, len - at - n);
+		len -= n;
+		break;
+	default:	/* insert a token, repeated to build long lines */
+		for (i = 0; tokens[i]; i++)
+			;
+		t = tokens[rand() % i];
+		tl = strlen(t);
+		for (n = rand() % 4 ? 1 : 1 + rand() % 600; n-- && len + tl < cap; len += tl) {
+			memmove(buf + at + tl, buf + at, len - at);
+			memcpy(buf + at, t, tl);
+		}
+	}
+	return len;
+}
+
+/* main - Replay each file given (AFL passes one), then -n rounds of mutations */
+int main(int argc, char **argv)
+{
+	static char seeds[256][MAXINPUT];
+	static size_t seedlen[256];
+	static char buf[MAXINPUT];
+	long rounds = 0, r;
+	int i, nseeds = 0, m;
+	size_t len;
+	FILE *fp;
+
+	LLVMFuzzerInitialize(&argc, &argv);
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+			rounds = atol(argv[++i]);
+			continue;
+		}
+		if ((fp = fopen(argv[i], "rb")) == NULL) {
+			perror(argv[i]);
+			return 1;
+		}
+		len = fread(buf, 1, sizeof(buf), fp);
+		fclose(fp);
+		LLVMFuzzerTestOneInput((uint8_t *)buf, len);
+		if (nseeds < 256) {
+			memcpy(seeds[nseeds], buf, len);
+			seedlen[nseeds++] = len;
+		}
+	}
+	if (nseeds == 0 && rounds > 0) {
+		seedlen[nseeds++] = 0;
+	}
+	srand(time(NULL));
+	for (r = 0; r < rounds; r++) {
+		i = rand() % nseeds;
+		len = seedlen[i];
+		memcpy(buf, seeds[i], len);
+		for (m = 1 + rand() % 8; m > 0; m--)
+			len = mutate(buf, len, sizeof(buf));
+		LLVMFuzzerTestOneInput((uint8_t *)buf, len);
+	}
+	fprintf(stderr, "fuzz_parse: %d inputs replayed, %ld mutations, no crash or slow parse\n", nseeds, rounds);
+	return 0;
+}
+#endif /* TSH_LIBFUZZER */
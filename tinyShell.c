@@ -3,7 +3,9 @@
  * 
  * Brittany Bergeron
  */
+#define _GNU_SOURCE			/* memfd_create */
 #include <stdio.h>
+#include <stdio_ext.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -13,18 +15,77 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+#include <sys/file.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <spawn.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <dlfcn.h>
+#include <alloca.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+#include "tsh.h"
 
-/* Misc manifest constants */
-#define MAXLINE    1024		/* max line size */
-#define MAXARGS     128		/* max args on a command line */
-#define MAXJOBS      16		/* max jobs at any point in time */
-#define MAXJID    1<<16		/* max job ID */
+/* tsh.h's names carry a TSH_ prefix for embedders; inside the shell the short ones */
+#define MAXLINE   TSH_MAXLINE
+#define MAXARGS   TSH_MAXARGS
+#define MAXJOBS   TSH_MAXJOBS
+#define MAXJID    TSH_MAXJID
+#define MAXEVENTS TSH_MAXEVENTS
+#define MAXSTAGES TSH_MAXSTAGES
+#define SHMCMDLEN TSH_SHMCMDLEN
+#define UNDEF     TSH_UNDEF
+#define FG        TSH_FG
+#define BG        TSH_BG
+#define ST        TSH_ST
 
-/* Job states */
-#define UNDEF 0		/* undefined */
-#define FG 1		/* running in foreground */
-#define BG 2		/* running in background */
-#define ST 3		/* stopped */
+/* Misc manifest constants (the rest are in tsh.h) */
+#define RCFILE   ".tshrc"	/* startup file in $HOME, interactive only */
+#define SHELLFD      10		/* the shell's own long-lived fds go at or above this */
+#define MAXRLIMITS    8		/* max @rlimit= entries per command */
+#define INBUFSIZE  4096		/* stdin bytes read per wakeup */
+#define MAXSCRIPTS    8		/* script texts kept by load_script */
+#define MAXSOURCE    32		/* max nesting of source/. */
+#define REEXEC_ENV "TSH_REEXEC_FD"	/* memfd with the state reexec hands over */
+#define DETACH_FILE "tsh-detached"	/* per-user registry of detached jobs */
+#define TIMING_ENV "TSH_TIMINGS"	/* file to log every job's timing to */
+#define SHM_NAME "/tsh-"		/* job table segment, suffixed with the shell's pid */
+#define WORKQ_NAME "/tsh-q-"	/* shared work queue segment, suffixed with its name */
+#define WORKQ_SLOTS 256		/* items a work queue holds */
+#define WORKQ_POLL (100 * 1000000)	/* ns a runner sleeps before checking for dead runners */
+#define MAXPLUGINS   32		/* loadable builtins (enable -f) */
+#define MAXGROUPS     8		/* job groups (group create) */
+#define REC_MAGIC "TSHREC1\n"	/* first bytes of a session recording (tsh -r) */
+#define REPLAY_WAIT (5 * 1000000LL)	/* us replay waits for the shell to reach a prompt */
+#define MAXHASHTHREADS 64	/* checksum worker threads at most */
+#define HASHBLOCK (1 << 20)	/* bytes checksum reads (and hashes) at a time */
+#define WALKBUF (64 << 10)	/* walk's getdents64 and per-thread output buffers */
+#define SPAWNRING   256		/* spawn results in flight between spawner threads and the shell */
+#define MAXBENCH      8		/* commands one bench compares */
+#define RINGSIZE (64 << 10)	/* bytes in flight between two threaded pipeline stages */
+#define STAGEBUF (8 << 10)	/* a stream builtin's output buffer */
+#define MAXSINKS      8		/* @dedup requesters per running command */
+#define DEDUPSLOTS   32		/* @dedup index size, a power of 2 above MAXJOBS */
+
+/* Event loop backends */
+#define EV_EPOLL 0
+#define EV_URING 1
 
 /* 
  * Jobs states: FG (foreground), BG (background), ST (stopped)
@@ -39,125 +100,836 @@
 /* Global variables */
 
 extern char **environ;		/* defined in libc */
-char prompt[] = "tsh> ";	/* command line prompt */
-int verbose = 0;			/* if true, print additional output */
-int nextjid = 1;			/* next job ID to allocate */
+char prompt[MAXLINE] = "tsh> ";	/* command line prompt (set with the prompt builtin) */
 char sbuf[MAXLINE];			/* for composing sprintf messages */
 
-/* The job struct */
-struct job_t { 
-    pid_t pid;				/* job PID */
-    int jid;				/* job ID [1, 2, ...] */
-    int state;				/* UNDEF, BG, FG, or ST */
-    char cmdline[MAXLINE];	/* command line */
+/* The context the signal handlers (and so every job helper) act on */
+struct tsh_ctx *ctx;
+char **shell_argv;			/* our argv, for reexec */
+struct tsh_shm *shm_tab;	/* published job table, NULL if not publishing */
+volatile sig_atomic_t interrupted;	/* ctrl-c with no foreground job: drain and wait give up */
+int builtin_status;			/* exit status of the last builtin that has one (wait, loadable ones) */
+int recfd = -1;				/* session recording (tsh -r), -1 if none */
+struct timespec rec_t0;		/* when it started */
+
+/* A script's text, cached by file identity and modification time */
+struct script_t {
+	dev_t dev;					/* file identity ... */
+	ino_t ino;
+	off_t size;					/* ... and version */
+	struct timespec mtime;
+	char *text;					/* whole file, NUL terminated */
+	size_t len;
+	int inuse;					/* being run; don't evict */
+	int uncached;				/* not in scripts[]: source_file frees it when done */
+};
+struct script_t scripts[MAXSCRIPTS];
+struct evloop *input_loop;		/* main's input loop (NULL in the library) */
+
+/* 
+ * One finished job in the timing log. Records are fixed-width so the
+ * log can be appended to from the SIGCHLD handler with a single write
+ * and read back by mmap'ing it as an array.
+ */
+struct timing_rec {
+	uint64_t cmdhash;			/* fnv1a of the full command line */
+	int64_t start_ns;			/* wall clock start, ns since the epoch */
+	int64_t dur_ns;				/* wall clock duration */
+	int64_t utime_us;			/* rusage user time */
+	int64_t stime_us;			/* rusage system time */
+	int64_t maxrss_kb;			/* rusage peak resident set */
+	int32_t status;				/* raw wait status */
+	char name[76];				/* argv[0], NUL padded (128 bytes in all) */
+};
+
+/* Durations of one command name, gathered by slowest */
+struct timing_group {
+	const char *name;			/* points into the mapped log */
+	uint64_t hash;
+	long long *dur;				/* durations, ns */
+	size_t n, cap;
+	long long p50, p99;
+};
+
+/* One hash in progress, of whichever algorithm */
+struct hash_state {
+	union {
+		uint32_t sha[8];		/* sha256 chaining value */
+		uint32_t crc;			/* crc32c so far, inverted */
+		uint64_t xx[4];			/* xxh64 lanes */
+	} h;
+	uint64_t total;				/* bytes fed in */
+	unsigned char buf[64];		/* a partial block, waiting for the rest */
+	size_t buflen;
+};
+
+/* A hash checksum knows: fed in chunks, writes len digest bytes to out */
+struct hash_algo {
+	char *name;
+	int len;
+	void (*init)(struct hash_state *hs);
+	void (*update)(struct hash_state *hs, const unsigned char *p, size_t n);
+	void (*final)(struct hash_state *hs, unsigned char *out);
+};
+
+/* One checksum command's files, shared by its worker threads */
+struct checksum_run {
+	const struct hash_algo *algo;
+	char **files;
+	int nfiles;
+	int next;					/* next file to hand out (atomic) */
+	char (*out)[65];			/* hex digest per file */
+	int *err;					/* errno per file, 0 if hashed */
+};
+
+/* A getdents64 record (glibc only declares it for its own wrapper) */
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/* A directory waiting to be read by walk */
+struct walk_dir {
+	char *path;
+	int depth;					/* 0 for a root */
+	struct walk_dir *next;
+};
+
+/* One walk command: its filters and the directories left to read */
+struct walk_run {
+	pthread_mutex_t lock;		/* guards stack and busy */
+	pthread_cond_t more;		/* a push, or the walk finished */
+	struct walk_dir *stack;		/* directories not yet taken */
+	int busy;					/* directories queued or being read */
+	pthread_mutex_t outlock;	/* one thread writes to stdout at a time */
+	char sep;					/* '\n', or '\0' for -0 */
+	int maxdepth;				/* -1 for no limit */
+	char *name;					/* -name glob, or NULL */
+	int type;					/* -type as a DT_* value, 0 for any */
+	int hassize, sizecmp;		/* -size given; +1 bigger, -1 smaller, 0 exactly */
+	off_t size;					/* in sizeunit units */
+	off_t sizeunit;				/* bytes per unit: 512 unless c, w, k, M or G */
+	int hasmtime, mtimecmp;		/* -mtime given; +1 older, -1 newer, 0 exactly */
+	long mtime;					/* days */
+	int needstat;				/* filters need more than d_type */
+	time_t now;
+};
+
+/* One posix_spawn result, published by a spawner thread */
+struct spawn_slot {
+	unsigned seq;				/* ring position + 1 once filled */
+	pid_t pid;
+	int err;					/* posix_spawn's error, 0 if started */
+	long long lat_ns;			/* time posix_spawn took */
+};
+
+/* One spawn command: what to start, and the ring its results come back on */
+struct spawn_run {
+	char **argv;
+	char **envp;				/* environ, or environ plus the command's NAME=value words */
+	int count;					/* copies to start */
+	int next;					/* copies claimed by spawners (atomic) */
+	unsigned tail;				/* next ring position to fill (atomic) */
+	unsigned head;				/* next ring position the shell reads; futex word for spawners
+								   waiting on a full ring */
+	int fullwait;				/* spawners waiting on head */
+	int waiting;				/* the shell is (about to be) asleep on evfd */
+	int evfd;					/* eventfd spawners bump to wake the shell */
+	int active;					/* spawner threads still running */
+	int stop;					/* ctrl-c: start no more */
+	posix_spawnattr_t attr;
+	struct spawn_slot ring[SPAWNRING];
+};
+
+/* One command bench times, and what its runs took */
+struct bench_cmd {
+	char *line;					/* the command as given */
+	char buf[MAXLINE];			/* its words, split by parseline */
+	char *argv[MAXARGS];
+	char **envp;				/* environ, or environ plus its NAME=value words */
+	long long *wall;			/* per run, ns */
+	long long user, sys;		/* CPU time over all runs, ns */
+	int nruns, nonzero;
+	double mean, sd;			/* wall time, ns */
+	long long median, p95;
+	int outliers;				/* runs outside the Tukey fences */
+};
+
+/* An in-process pipe between two threaded pipeline stages: one writer, one reader */
+struct spsc_ring {
+	size_t head;				/* bytes written so far; only the writer moves it */
+	size_t tail;				/* bytes read so far; only the reader moves it */
+	unsigned seq;				/* futex word, bumped whenever either end moves or closes */
+	int waiting;				/* ends asleep (or about to be) on seq */
+	int wclosed, rclosed;		/* the writer is done; the reader reads no more */
+	char buf[RINGSIZE];
+};
+
+/* Where a stream builtin reads or writes: a real fd, or a ring to a neighbouring stage */
+struct stage_io {
+	int fd;						/* -1 for the ring */
+	struct spsc_ring *ring;
+	size_t len;					/* output buffered in buf */
+	char buf[STAGEBUF];
+};
+
+/* A builtin that streams stdin to stdout, so it can run as a pipeline thread */
+struct stage_builtin {
+	const char *name;
+	int (*run)(char **argv, struct stage_io *in, struct stage_io *out);
+};
+
+/* One stage of a threaded run */
+struct stage_thread {
+	pthread_t tid;
+	char **argv;
+	const struct stage_builtin *sb;
+	struct stage_io in, out;
+	int status;					/* its exit status */
+};
+
+/* 
+ * A work queue shared by every shell that enqueues to or drains it, in
+ * the segment /tsh-q-NAME. A slot's lease word says who has it: the
+ * owning pid in the high half, a WQ_* state in the low byte.
+ */
+struct workq {
+	unsigned nready;			/* futex word, bumped whenever an item becomes ready */
+	uint64_t tickets;			/* next enqueue ticket; oldest ticket runs first */
+	uint64_t ndone;				/* items finished, by any runner */
+	uint64_t lease[WORKQ_SLOTS];
+	uint64_t ticket[WORKQ_SLOTS];
+	char cmd[WORKQ_SLOTS][MAXLINE];
+};
+#define WQ_FREE    0
+#define WQ_FILLING 1			/* an enqueuer is writing it */
+#define WQ_READY   2			/* waiting for a runner */
+#define WQ_LEASED  3			/* a runner is running it */
+#define WORKQ_LEASE(pid, state) ((uint64_t)(pid) << 32 | (state))
+
+/* 
+ * A session recording (tsh -r) is REC_MAGIC, then records: this header
+ * and len bytes of data. t_us counts from the start of the session
+ * and wraps after 71 minutes; only differences between records matter.
+ */
+struct rec_hdr {
+	uint32_t t_us;
+	uint16_t type;				/* REC_* */
+	uint16_t len;				/* data bytes that follow */
+} __attribute__((packed));
+#define REC_INPUT  1			/* bytes read from stdin; len 0 is end of input */
+#define REC_SIGNAL 2			/* int: ctrl-c or ctrl-z signal the shell got */
+#define REC_EXIT   3			/* int pid, int wait status: a job ended */
+#define REC_PROMPT 4			/* the shell is ready for its next line */
+
+/* A replay in progress (tsh -R): the shell being fed, and what it has done */
+struct replay {
+	int master;					/* pty the shell runs on */
+	int recfd;					/* the shell's own recording, from a pipe */
+	pid_t child;
+	int gone;					/* the shell closed the pty or the pipe */
+	char rbuf[2 * INBUFSIZE];	/* recording bytes not parsed yet */
+	int rlen;
+	int magic;					/* bytes of its REC_MAGIC still to skip */
+	int nprompts;				/* prompts seen so far ... */
+	long long *arrive;			/* ... and when each came (now_us) */
+	long long line_sent;		/* when a line went in with no prompt since, or -1 */
+	long long echo_sent;		/* when input went in with no echo seen yet, or -1 */
+	char echo_ch;				/* that input's first byte */
+	long long *plat, *elat;		/* prompt return and echo latencies, us */
+	int nplat, nelat;
+};
+
+/* A job group; its members are linked through job_t.gprev/gnext */
+struct job_group {
+	char name[32];				/* "" for a free slot */
+	int first;					/* job slot of the first member, -1 if none */
+	int nmembers;
+	int ndone;					/* members finished so far */
+	int nfailed;				/* of those, ones that didn't exit 0 */
+};
+
+/* A loadable builtin named by enable -f; its object is opened on first use */
+struct plugin {
+	char name[64];
+	char *path;					/* the shared object */
+	tsh_builtin_fn *fn;			/* tsh_builtin_<name>, NULL until loaded */
+};
+
+/* Where one @dedup requester's copy of the output goes */
+struct dedup_sink {
+	char *path;					/* its > or >> file, NULL for the shell's stdout */
+	int flags;					/* open() flags for path */
+};
+
+/* 
+ * An @dedup leader: a running command that identical @dedup commands
+ * attach to instead of starting their own copy. Its stdout is captured
+ * in memfd and copied to every requester's sink when it finishes.
+ */
+struct dedup_ent {
+	int state;					/* DEDUP_* */
+	uint64_t digest;			/* dedup_digest of the command */
+	pid_t pid;					/* the leader's job */
+	int status;					/* its wait status, once DONE */
+	int memfd;					/* captured stdout */
+	int nsinks;
+	struct dedup_sink sinks[MAXSINKS];
+};
+#define DEDUP_FREE     0
+#define DEDUP_STARTING 1		/* being launched, not indexed yet */
+#define DEDUP_RUNNING  2		/* indexed; requests attach to it */
+#define DEDUP_DONE     3		/* reaped, output not delivered yet */
+
+/* Running @dedup commands, and the index over them by digest (-1 empty) */
+struct dedup_ent dedup_ents[MAXJOBS];
+struct plugin plugins[MAXPLUGINS];
+int nplugins;
+struct job_group groups[MAXGROUPS];
+int dedup_idx[DEDUPSLOTS] = { [0 ... DEDUPSLOTS - 1] = -1 };
+
+/* One redirection: fd is pointed at path (opened with flags) or at dupfd */
+struct redir {
+	int fd;			/* fd being redirected */
+	int flags;		/* open() flags, or -1 for a dup */
+	int dupfd;		/* fd to duplicate for >&N / <&N, -1 to close */
+	char *path;		/* file for < > >> */
+};
+
+/* Per-command launch options, given as leading @key=value words */
+struct launch_opts {
+	int dedup;							/* @dedup: join an identical running command */
+	int env_clean;						/* @env=clean: start from an empty environment */
+	struct job_group *group;			/* @group=: group the job joins, or NULL */
+	int nrlimits;						/* entries used in rl/rl_res */
+	int rl_res[MAXRLIMITS];				/* RLIMIT_* to set in the child */
+	struct rlimit rl[MAXRLIMITS];		/* soft and hard value for each */
+};
+
+/* 
+ * environ indexed by name, so a command's NAME=value words find the
+ * slots they replace without a scan. Built on first use and again
+ * after env_changed; every setenv/unsetenv the shell does calls that.
+ */
+struct env_index {
+	char **base;				/* the environ it indexes */
+	int n;						/* entries in base */
+	int size;					/* slots: a power of 2, at least twice n */
+	int *slot;					/* position in base + 1, 0 if empty */
+	int valid;					/* cleared by env_changed */
+};
+struct env_index envidx;
+
+/* 
+ * The read loop's input side: stdin plus the context's wakefd, which
+ * the signal handlers bump. With epoll each wakeup costs an epoll_wait
+ * and a read; with io_uring the reads themselves sit in the ring, so
+ * one io_uring_enter both waits and delivers the data.
+ */
+struct evloop {
+	int backend;				/* EV_EPOLL or EV_URING */
+	int wakefd;					/* eventfd shared with the context */
+	char inbuf[INBUFSIZE];		/* stdin bytes not yet handed out as lines */
+	int inlen;					/* bytes in inbuf */
+	unsigned long nsyscalls;	/* syscalls spent waiting and reading */
+
+	/* epoll backend */
+	int epfd;
+	int stdin_file;				/* stdin can't be polled (regular file) */
+
+	/* io_uring backend */
+	int ringfd;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	int eof;					/* a read ahead hit end of input */
+	int nsubmit;				/* sqes queued since the last enter */
+	int reading;				/* stdin read in flight */
+	int waking;					/* wakefd read in flight */
+	uint64_t wakeval;			/* the wakefd read lands here */
+};
+
+/* io_uring user_data tags */
+#define UD_STDIN  1
+#define UD_WAKE   2
+#define UD_CANCEL 3
+
+/* Signals the trap builtin knows by name */
+struct trap_name {
+	char *name;
+	int sig;
+};
+struct trap_name trap_names[] = {
+	{"EXIT", TRAP_EXIT}, {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT},
+	{"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"ALRM", SIGALRM}, {"TERM", SIGTERM},
+	{"CHLD", SIGCHLD}, {"TSTP", SIGTSTP}, {"WINCH", SIGWINCH}, {"ERR", TRAP_ERR},
+	{NULL, 0}
 };
 
-/* The job list */
-struct job_t jobs[MAXJOBS]; 
+/* Resource limits known to ulimit and @rlimit= */
+struct rlimit_name {
+	char *name;		/* @rlimit= key */
+	char flag;		/* ulimit option letter */
+	int resource;	/* RLIMIT_* */
+	rlim_t unit;	/* bytes per unit of a ulimit value */
+	char *desc;		/* shown by ulimit -a */
+};
+struct rlimit_name rlimit_names[] = {
+	{"core",   'c', RLIMIT_CORE,   1024, "core file size (kbytes)"},
+	{"nofile", 'n', RLIMIT_NOFILE, 1,    "open files"},
+	{"cpu",    't', RLIMIT_CPU,    1,    "cpu time (seconds)"},
+	{"nproc",  'u', RLIMIT_NPROC,  1,    "max user processes"},
+	{"as",     'v', RLIMIT_AS,     1024, "virtual memory (kbytes)"},
+	{NULL, 0, 0, 0, NULL}
+};
 
 
 /* Function prototypes */
 
 /* Here are the functions that you will implement */
-void eval(char *cmdline);
+int eval(const char *cmdline, struct tsh_result *res);
+int split_pipeline(char **argv, char ***stages);
+void run_stage(char **argv, struct launch_opts *opts, sigset_t *mask);
+int thread_run(char ***stages, int i, int nstages);
+void run_threads(char ***stages, int n, int *codes, struct launch_opts *opts, sigset_t *mask);
+void *stage_thread_main(void *arg);
+void stage_signals(void);
+int has_redir(char **argv);
+const struct stage_builtin *find_stage_builtin(const char *name);
+int stage_cat(char **argv, struct stage_io *in, struct stage_io *out);
+int stage_wc(char **argv, struct stage_io *in, struct stage_io *out);
+int stage_printf(char **argv, struct stage_io *in, struct stage_io *out);
+ssize_t ring_read(struct spsc_ring *r, char *p, size_t n);
+ssize_t ring_write(struct spsc_ring *r, const char *p, size_t n);
+void ring_sleep(struct spsc_ring *r, int writer);
+void ring_wake(struct spsc_ring *r);
+ssize_t sio_read(struct stage_io *io, char *p, size_t n);
+int sio_write(struct stage_io *io, const char *p, size_t n);
+int sio_flush(struct stage_io *io);
+int sio_put(struct stage_io *io, const char *p, size_t n);
+int sio_end_write(struct stage_io *io);
+void sio_end_read(struct stage_io *io);
+int env_words(char **argv);
+void make_envp(char **envp, char **base, char **delta, int n);
+struct env_index *env_index(void);
+int env_find(struct env_index *ix, const char *name, size_t len);
+void env_changed(void);
 int builtin_cmd(char **argv);
 void do_bgfg(char **argv);
-void do_redirect(char **argv);
+void log_timing(struct job_t *job, int status, struct rusage *ru);
+void timing_open(void);
+uint64_t fnv1a(const char *s);
+uint64_t fnv1a_n(const char *s, size_t n);
+void do_slowest(char **argv);
+struct timing_group *regroup(struct timing_group *tab, size_t *cap);
+int cmp_ll(const void *a, const void *b);
+long long pct_rank(const long long *v, int n, int pct);
+int cmp_group_p99(const void *a, const void *b);
+void do_checksum(char **argv);
+void *checksum_worker(void *arg);
+int hash_file(const struct hash_algo *algo, const char *path, unsigned char *buf, unsigned char *out);
+void hash_setup(void);
+void sha256_init(struct hash_state *hs);
+void sha256_update(struct hash_state *hs, const unsigned char *p, size_t n);
+void sha256_final(struct hash_state *hs, unsigned char *out);
+void sha256_blocks_sw(uint32_t st[8], const unsigned char *p, size_t nblocks);
+void crc32c_init(struct hash_state *hs);
+void crc32c_more(struct hash_state *hs, const unsigned char *p, size_t n);
+void crc32c_final(struct hash_state *hs, unsigned char *out);
+uint32_t crc32c_update_sw(uint32_t crc, const unsigned char *p, size_t n);
+void xxh64_init(struct hash_state *hs);
+void xxh64_update(struct hash_state *hs, const unsigned char *p, size_t n);
+void xxh64_final(struct hash_state *hs, unsigned char *out);
+uint64_t xxh64_round(uint64_t acc, uint64_t in);
+void do_walk(char **argv);
+void *walk_worker(void *arg);
+void walk_read(struct walk_run *run, struct walk_dir *d, char *buf, size_t *len);
+int walk_match(struct walk_run *run, const char *path, int type, struct stat *st);
+void walk_push(struct walk_run *run, struct walk_dir *d);
+void walk_emit(struct walk_run *run, char *buf, size_t *len, const char *path);
+void walk_flush(struct walk_run *run, char *buf, size_t *len);
+void do_spawn(char **argv);
+void *spawn_worker(void *arg);
+void spawn_wake(struct spawn_run *run);
+int spawn_unreaped(pid_t *pids, int npids, pid_t *gone, int ngone, int sig, int *strays);
+int cmp_pid(const void *a, const void *b);
+void do_bench(char **argv);
+int bench_run(struct bench_cmd *b, posix_spawnattr_t *attr, posix_spawn_file_actions_t *fa);
+void bench_stats(struct bench_cmd *b);
+void bench_json(FILE *fp, struct bench_cmd *cmds, int ncmds, int runs, int warmups);
+void json_str(FILE *fp, const char *s);
+double sqrt_nr(double x);
+struct workq *workq_open(const char *name);
+int workq_take(struct workq *q);
+int workq_put(struct workq *q, const char *cmdline);
+void workq_wake(struct workq *q);
+void workq_wait(struct workq *q, unsigned seen);
+int workq_recover(struct workq *q);
+void do_enqueue(char **argv);
+void do_drain(char **argv);
+void do_enable(char **argv);
+struct plugin *find_plugin(const char *name);
+int run_plugin(struct plugin *pl, char **argv);
+int plugin_setenv(const char *name, const char *value);
+void do_group(char **argv);
+struct job_group *find_group(const char *name);
+void group_join(struct job_t *job, struct job_group *g);
+void group_leave(struct job_t *job);
+void group_status(struct job_group *g);
+void list_groups(void);
+void do_group_bgfg(char **argv, struct job_group *g);
+int jobs_named(char *cmd, char *arg, struct job_t **out);
+void do_kill(char **argv);
+void do_wait(char **argv);
+#if defined(__x86_64__)
+void sha256_blocks_ni(uint32_t st[8], const unsigned char *p, size_t nblocks);
+uint32_t crc32c_update_hw(uint32_t crc, const unsigned char *p, size_t n);
+#endif
+struct job_t *getjobarg(char **argv);
+void do_detach(char **argv);
+void do_attach(char **argv);
+void poll_adopted(struct tsh_ctx *c);
+void waitfg_adopted(struct job_t *job);
+int proc_state(pid_t pid, unsigned long long *start);
+int registry_path(char *buf, size_t len);
+int registry_open(int flags);
+int do_redirect(char **argv);
+int fd_high(int fd);
+int shell_fd(int fd);
+int parse_redir(char **argv, int i, struct redir *rd);
+int apply_redir(struct redir *rd);
+void do_exec(char **argv);
+int parse_launch_opts(char **argv, struct launch_opts *opts);
+void apply_rlimits(struct launch_opts *opts);
+uint64_t dedup_digest(char ***stages, int nstages, struct dedup_sink *sink);
+uint64_t fnv1a_more(uint64_t h, const char *s);
+struct dedup_ent *dedup_lookup(uint64_t digest);
+struct dedup_ent *dedup_add(uint64_t digest, struct dedup_sink *sink);
+void dedup_start(struct dedup_ent *dd, pid_t pid);
+struct job_t *dedup_attach(struct dedup_ent *dd, struct dedup_sink *sink, int bg);
+void dedup_sink_add(struct dedup_ent *dd, struct dedup_sink *sink);
+void dedup_done(pid_t pid, int status);
+void dedup_deliver(void);
+int parse_rlim(const char *str, rlim_t unit, rlim_t *val);
+void do_ulimit(char **argv);
+void do_set(char **argv);
+void do_pipestatus(char **argv);
+int pipe_status(struct job_t *job);
+int status_code(int status);
+void do_trap(char **argv);
+void run_traps(struct tsh_ctx *c);
+void shell_exit(int status);
+void do_reexec(char **argv);
+int save_state(int fd);
+void restore_state(struct evloop *ev);
+int ev_init(struct evloop *ev, int backend, int wakefd);
+int ev_fill(struct evloop *ev);
+void ev_restart(struct evloop *ev);
+int read_line(struct evloop *ev, char *cmdline);
+int ev_readahead(struct evloop *ev, sigset_t *prev);
+void ev_giveback(struct evloop *ev);
+int ev_line_ready(struct evloop *ev);
+int stdin_redirected(char **argv);
+int uring_setup(struct evloop *ev);
+struct io_uring_sqe *uring_sqe(struct evloop *ev);
+int uring_enter(struct evloop *ev, int wait);
+int uring_fill(struct evloop *ev);
+int epoll_fill(struct evloop *ev);
 void waitfg(pid_t pid);
+int source_file(const char *path);
+struct script_t *load_script(const char *path);
+void run_script_child(const char *path);
+void load_rc(void);
 
 void sigchld_handler(int sig);
+int reap_child(pid_t pid, int status, struct rusage *ru);
 void sigtstp_handler(int sig);
 void sigint_handler(int sig);
+int kill_fg(int sig);
+void trap_handler(int sig);
+void mark_trap(int sig);
+void wake_main(void);
 
 /* Here are helper routines that we've provided for you */
-int parseline(const char *cmdline, char **argv); 
+int parseline(const char *cmdline, char *buf, char **argv); 
 void sigquit_handler(int sig);
 
 void clearjob(struct job_t *job);
 void initjobs(struct job_t *jobs);
 int maxjid(struct job_t *jobs); 
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline);
+int addjob(struct job_t *jobs, pid_t pid, int state, const char *cmdline);
 int deletejob(struct job_t *jobs, pid_t pid); 
 pid_t fgpid(struct job_t *jobs);
 struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
+struct job_t *getjobstage(struct job_t *jobs, pid_t pid, int *stage);
 struct job_t *getjobjid(struct job_t *jobs, int jid); 
 int pid2jid(pid_t pid); 
 void listjobs(struct job_t *jobs);
+void queue_event(struct job_t *job, int event, int status);
+void report_event(struct job_event *ev);
 
+void shm_setup(void);
+void shm_cleanup(void);
+void shm_publish(struct job_t *job);
+int shm_monitor(const char *pid);
+void rec_open(const char *path);
+void rec_event(int type, const void *data, int len);
+long long now_us(void);
+int replay(const char *path);
+void replay_pump(struct replay *rp, int nprompts, long long deadline);
+void replay_stats(const char *what, long long *lat, int n);
 void usage(void);
 void unix_error(char *msg);
 void app_error(char *msg);
 typedef void handler_t(int);
 handler_t *Signal(int signum, handler_t *handler);
 
+/* The stream builtins, which a pipeline can run as threads of one child */
+struct stage_builtin stage_builtins[] = {
+	{"cat",    stage_cat},
+	{"wc",     stage_wc},
+	{"printf", stage_printf},
+	{NULL, NULL}
+};
+
+/* The hashes checksum offers, the first being the default */
+struct hash_algo hash_algos[] = {
+	{"sha256", 32, sha256_init, sha256_update, sha256_final},
+	{"crc32c", 4,  crc32c_init, crc32c_more,   crc32c_final},
+	{"xxh64",  8,  xxh64_init,  xxh64_update,  xxh64_final},
+	{NULL, 0, NULL, NULL, NULL}
+};
+/* Block functions; hash_setup switches them to the CPU's instructions */
+void (*sha256_blocks)(uint32_t st[8], const unsigned char *p, size_t nblocks) = sha256_blocks_sw;
+uint32_t (*crc32c_update)(uint32_t crc, const unsigned char *p, size_t n) = crc32c_update_sw;
+uint32_t crc32c_table[256];
+const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
 
-/* main - The shell's main routine */
+#ifndef TSH_LIBRARY
+/* main - The shell's main routine, a read/eval loop over tsh_eval() */
 int main(int argc, char **argv) {
 	char c;
 	char cmdline[MAXLINE];
 	 int emit_prompt = 1; /* emit prompt (default) */
+	char *command = NULL;	/* -c command string, run once then exit */
+	static struct tsh_ctx shell;	/* the one shell context */
+	static struct evloop loop;	/* waits for input and signal wakeups */
+	int backend = EV_EPOLL;	/* -e io_uring to opt in */
+	struct tsh_result res;	/* how -c's command ended */
+	int status;				/* and so how we exit */
 
 	/* Redirect stderr to stdout (so that driver will get all output on the pipe connected to stdout) */
 	/*copy file descriptor*/
 	dup2(1, 2);
 
+	/* Initialize the job list and install the signal handlers */
+	tsh_init(&shell);
+	shell_argv = argv;
+
 	/* Parse the command line */
-	while ((c = getopt(argc, argv, "hvp")) != EOF) {
+	while ((c = getopt(argc, argv, "hvpc:e:m:r:R:")) != EOF) {
 		switch (c) {
 			case 'h':				/* print help message */
 			usage();
 			break;
 			case 'v':				/* emit additional diagnostic info */
-				verbose = 1;
+				shell.verbose = 1;
 				break;
 			case'p':				/* don't print a prompt */
 				emit_prompt = 0;	/* handy for automatic testing */
 				break;
+			case 'c':				/* run a single command and exit */
+				command = optarg;
+				break;
+			case 'e':				/* event loop backend */
+				if (!strcmp(optarg, "io_uring"))
+					backend = EV_URING;
+				else if (strcmp(optarg, "epoll"))
+					usage();
+				break;
+			case 'm':				/* print shell PID's job table and exit */
+				exit(shm_monitor(optarg));
+			case 'r':				/* record the session */
+				rec_open(optarg);
+				break;
+			case 'R':				/* replay a recorded session into a new shell */
+				exit(replay(optarg));
 			default:
 				usage();
 		}
 	} 
 
-	/* Install the signal handlers */
-
-	/* These are the ones you will need to implement */
-	Signal(SIGINT,  sigint_handler);   /* ctrl-c */
-	Signal(SIGTSTP, sigtstp_handler);  /* ctrl-z */
-	Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
-
-	/* Ignoring these signals simplifies reading from stdin/stdout */
-	Signal(SIGTTIN, SIG_IGN);            /* ignore SIGTTIN */
-	Signal(SIGTTOU, SIG_IGN);          /* ignore SIGTTOU */
+	/* -c: evaluate the one command and leave without touching the rc file */
+	if(command != NULL){
+		status = 0;
+		//started by reexec from that command: the old image ran it, only the exit is left
+		if(getenv(REEXEC_ENV) == NULL){
+			snprintf(cmdline, MAXLINE, "%s\n", command);
+			tsh_eval(&shell, cmdline, &res);
+			//exit as the command did: a builtin's status, or a finished foreground job's
+			if(res.builtin){
+				status = builtin_status;
+			}
+			else if(res.state == UNDEF){
+				status = status_code(res.status);
+			}
+		}
+		fflush(stdout);
+		shell_exit(status);
+	}
 
-	/* This one provides a clean way to kill the shell */
-	Signal(SIGQUIT, sigquit_handler); 
+	//wake the loop from the signal handlers; falls back to epoll if io_uring is unavailable
+	shell.wakefd = fd_high(eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC));
+	backend = ev_init(&loop, backend, shell.wakefd);
+	input_loop = &loop;
+	//publish the job table for monitors (before restore_state re-adds any jobs)
+	shm_setup();
 
-	/* Initialize the job list */
-	initjobs(jobs);
+	//started by reexec: the old image's jobs, traps and unread input carry on here
+	if(getenv(REEXEC_ENV) != NULL){
+		restore_state(&loop);
+	}
+	//startup file is only for interactive sessions, so scripted runs start fast
+	else if(emit_prompt && isatty(STDIN_FILENO)){
+		load_rc();
+	}
 
 	/* Execute the shell's read/eval loop */
 	while (1) {
+		//report background jobs that stopped or died since the last line
+		tsh_events(&shell);
+
 		/* Read command line */
 		if (emit_prompt) {
 			printf("%s", prompt);
 			fflush(stdout);
 		}
-		if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-			app_error("fgets error");
+		//ready for the next line: what a replay times prompt return by
+		rec_event(REC_PROMPT, NULL, 0);
+		//background job reports and traps are handled while we wait here
+		if (read_line(&loop, cmdline) < 0)
+			unix_error("read error");
 		
-		if (feof(stdin)) {                      /* End of file (ctrl-d) */
+		if (cmdline[0] == '\0') {               /* End of file (ctrl-d) */
+			if (shell.verbose)
+				printf("evloop: %s, %lu syscalls for %lu completed jobs\n",
+					backend == EV_URING ? "io_uring" : "epoll", loop.nsyscalls, shell.ndone);
 			fflush(stdout);
-			exit(0);
+			shell_exit(0);
 		}
 
 		/* Evaluate the command line  and flush stdout buffer*/
-		eval(cmdline);
-		fflush(stdout);
-		fflush(stdout);
+		tsh_eval(&shell, cmdline, NULL);
+		//with the next line already read (say a run of & lines) go straight on; flush before we'd wait
+		if (!ev_line_ready(&loop))
+			fflush(stdout);
 	} 
 
 	exit(0); /* control never reaches here */
 }//end main
+#endif /* TSH_LIBRARY */
+
+/* 
+* tsh_init - Set up a shell context and point the signal handlers at it
+*/
+void tsh_init(struct tsh_ctx *c){
+	memset(c, 0, sizeof(*c));
+	c->nextjid = 1;
+	c->wakefd = -1;
+	c->timingfd = -1;
+	initjobs(c->jobs);
+	ctx = c;
+
+	/* Install the signal handlers */
+
+	/* These are the ones you will need to implement */
+	Signal(SIGINT,  sigint_handler);   /* ctrl-c */
+	Signal(SIGTSTP, sigtstp_handler);  /* ctrl-z */
+	Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
+
+	/* Ignoring these signals simplifies reading from stdin/stdout */
+	Signal(SIGTTIN, SIG_IGN);            /* ignore SIGTTIN */
+	Signal(SIGTTOU, SIG_IGN);          /* ignore SIGTTOU */
+
+	/* This one provides a clean way to kill the shell */
+	Signal(SIGQUIT, sigquit_handler); 
+}
+
+/* 
+* tsh_eval - Evaluate one command line in context c and report job events
+*
+* res (may be NULL) says what was run and how a foreground job ended.
+* Returns the foreground job's wait status (a loadable builtin's exit
+* status comes the same way), 0 for other builtins and BG jobs.
+*/
+int tsh_eval(struct tsh_ctx *c, const char *cmdline, struct tsh_result *res){
+	struct tsh_result r;
+
+	ctx = c;
+	eval(cmdline, &r);
+	//a foreground command that failed fires the ERR trap
+	if(!r.builtin && r.state == UNDEF && r.status != 0){
+		mark_trap(TRAP_ERR);
+	}
+	tsh_events(c);
+	if(res){*res = r;}
+	return r.status;
+}
+
+/* 
+* tsh_events - Hand queued job events to the context's callback
+*
+* The SIGCHLD handler only queues; printing (or whatever the embedder's
+* on_job does) happens here, outside of signal context. Pending traps
+* run afterwards, so a CHLD trap sees the job list already updated.
+*/
+void tsh_events(struct tsh_ctx *c){
+	struct job_event evs[MAXEVENTS];
+	sigset_t mask, prev;
+	int i, n;
+
+	//attached jobs' exits go on the queue with the rest
+	poll_adopted(c);
+	//nothing queued: skip the two sigprocmasks (an event landing now is seen next time)
+	if(c->nevents == 0){
+		dedup_deliver();
+		run_traps(c);
+		return;
+	}
+	//copy the queue out with SIGCHLD blocked so the handler can't append mid-copy
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &prev);
+	n = c->nevents;
+	memcpy(evs, c->events, n * sizeof(evs[0]));
+	c->nevents = 0;
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+
+	for(i = 0; i < n; i++){
+		if(c->on_job){
+			c->on_job(&evs[i], c->udata);
+		}
+		else{
+			report_event(&evs[i]);
+		}
+	}
+	dedup_deliver();
+	run_traps(c);
+}
 
 /* 
 * eval - Evaluate the command line that the user has just typed in
@@ -169,16 +941,32 @@ int main(int argc, char **argv) {
  *       background children don't receive SIGINT (SIGTSTP) from the kernel
  *       when we type ctrl-c (ctrl-z) at the keyboard.  
 */
-void eval(char *cmdline) {
+int eval(const char *cmdline, struct tsh_result *res) {
 	/*csapp: page 735*/
 	/*ch.8 sides for signal handling)*/
 
-	//character pointer for arg list 
+	//character pointer for arg list, and the buffer the args live in
 	char *argv[MAXARGS];
+	char buf[MAXLINE];
+	struct tsh_result r = {1, 0, 0, UNDEF, 0};
+	struct job_t *job;
+	struct launch_opts opts;
 	//determines if background or foreground
 	int bg;
 	//pid of current(parent, child, etc)
-	pid_t pid;
+	pid_t pid, pgid;
+	//pipeline stages, and the pipe between the last stage forked and the next
+	char **stages[MAXSTAGES];
+	int nstages, i, k, last, infd, pfd[2];
+	//where threaded runs leave each of their stages' exit codes
+	int *runst;
+	//the first stage's stdin is redirected, so its input isn't ours to leave alone
+	int readahead;
+	//@dedup: the leader entry this launch captures for, or the job it attached to
+	struct dedup_ent *dd;
+	struct dedup_sink sink;
+	struct job_t *attached;
+	uint64_t digest;
 
 	//mask for sigproc
 	sigset_t mask;
@@ -190,210 +978,4925 @@ void eval(char *cmdline) {
 	sigaddset(&mask, SIGINT);
 
 	//assign if bg or fg based on input
-	bg = parseline(cmdline, argv);
+	bg = parseline(cmdline, buf, argv);
 	
+	//strip any leading @key=value launch options; a bad one cancels the command
+	if(argv[0] != NULL && parse_launch_opts(argv, &opts) < 0){
+		if(res){*res = r;}
+		return 0;
+	}
+
 	//undefined, return
 	if(argv[0] == NULL){
-		return;
+		if(res){*res = r;}
+		return 0;
+	}
+	//attached jobs send no SIGCHLD, so catch up on any that exited before jobs/fg/bg see them
+	poll_adopted(ctx);
+	//cut the line into stages at each | word
+	if((nstages = split_pipeline(argv, stages)) < 0){
+		if(res){*res = r;}
+		return 0;
 	}
-	//check if built in; execute if so, else continue
-	if(!builtin_cmd(argv)){
+	//check if built in; execute if so, else continue (a builtin in a pipeline runs in its stage's child,
+	//and a stream builtin like cat always gets a child, so it never reads the shell's own input)
+	if(nstages > 1 || find_stage_builtin(argv[0]) || !builtin_cmd(argv)){
+
+		//timing log is opened on the first job, so builtin-only runs never touch it
+		timing_open();
+
+		//a foreground job's output must come after ours; a run of & lines can batch theirs
+		if(!bg){
+			fflush(stdout);
+		}
+		//a foreground job reading our stdin gets the input we read past its line back, where the file allows
+		readahead = stdin_redirected(stages[0]);
+		if(!readahead && !bg && input_loop){
+			ev_giveback(input_loop);
+		}
+		//stages with NAME=value words build their environment from the index: build it once, here, for all of them
+		for(i = 0; i < nstages; i++){
+			if(env_words(stages[i]) > 0){
+				env_index();
+				break;
+			}
+		}
 
 		/*handling some pid and fork stuff, error control*/
 		//block to avoid race condition
 		sigprocmask(SIG_BLOCK, &mask, NULL);		/*cs:app, 753-754, slide 99/108 ch 8 for signal blocking*/
-		//fork process, set pid (region not interrupted by block)
-		pid = fork();
+		job = NULL;
+		pgid = 0;
+		infd = -1;
+		runst = NULL;
 
-		if(pid < 0){
-			//print error
-			unix_error("Fork error");
-			//return pid;
-			return;
+		//@dedup: an identical command already running takes this request on instead
+		dd = NULL;
+		attached = NULL;
+		if(opts.dedup){
+			digest = dedup_digest(stages, nstages, &sink);
+			if((dd = dedup_lookup(digest)) == NULL || (attached = dedup_attach(dd, &sink, bg)) == NULL){
+				//this one leads, its output captured for everyone who attaches
+				dd = dedup_add(digest, &sink);
+			}
 		}
 
-		//child will return 0 and execute this if statement
-		if(pid == 0){
-			do_redirect(argv);
-			//keep child out of forground process group
-			setpgid(0,0);
-			//unblock in child fork
-			sigprocmask(SIG_UNBLOCK, &mask, NULL);
+		//(an attached request starts nothing)
+		for(i = 0; attached == NULL && i < nstages; i = last + 1){
+			//stages i..last are adjacent stream builtins that share one child as threads, or just stage i
+			last = thread_run(stages, i, nstages);
+			if(last > i && runst == NULL){
+				runst = mmap(NULL, MAXSTAGES * sizeof(int), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+				//without it the run's stages all report its child's status
+				runst = (runst == MAP_FAILED) ? NULL : memset(runst, -1, MAXSTAGES * sizeof(int));
+			}
+			//each child but the last writes into a fresh pipe; CLOEXEC keeps the ends out of every other exec
+			pfd[0] = pfd[1] = -1;
+			if(last < nstages - 1 && pipe2(pfd, O_CLOEXEC) < 0){
+				unix_error("Pipe error");
+			}
+			//fork process, set pid (region not interrupted by block)
+			pid = fork();
 
-			//returns an error message and quits process if not applicable cmd(execve returned for error)
-			if(execve(argv[0], argv, environ) < 0){
-				printf("%s: Command not found.\n", argv[0]);
-				exit(0);
+			if(pid < 0){
+				//print error
+				unix_error("Fork error");
+				//return pid;
+				return 0;
 			}
-		}
-		//pid is negative: error
-		
 
-		/*parent job*/
+			//child will return 0 and execute this if statement
+			if(pid == 0){
+				//what the shell has buffered is the shell's to print, not a second time from here
+				__fpurge(stdout);
+				//likewise the published job table: a builtin or script changing the child's
+				//copy of the job list must not show up in the shell's /tsh-PID
+				if(shm_tab){
+					munmap(shm_tab, sizeof(*shm_tab));
+					shm_tab = NULL;
+				}
+				//pipe ends go on 0 and 1 first, so the stage's own redirections win
+				if(infd >= 0){
+					dup2(infd, 0);
+					close(infd);
+				}
+				if(pfd[1] >= 0){
+					dup2(pfd[1], 1);
+					close(pfd[1]);
+					close(pfd[0]);
+				}
+				//an @dedup leader's last stage writes into the capture for its requesters
+				else if(dd){
+					dup2(dd->memfd, 1);
+				}
+				//keep child out of forground process group; later stages join the first one's
+				setpgid(0, pgid);
+				if(last > i){
+					run_threads(&stages[i], last - i + 1, runst ? runst + i : NULL, &opts, &mask);
+				}
+				run_stage(stages[i], &opts, &mask);
+			}
+			//pid is negative: error
 
-		/*determine fg/bg jobs*/
-		//foreground jobs
-		if(!bg){
-			//add to jobs list
-			addjob(jobs, pid, FG, cmdline);
+			/*parent job*/
+			//set the group here too, so a fast stage can't exec before it has one
+			setpgid(pid, pgid);
+			if(i == 0){
+				pgid = pid;
+				/*determine fg/bg jobs*/
+				//add to jobs list as FG or BG; the first stage's pid names the job
+				if(addjob(ctx->jobs, pid, bg ? BG : FG, cmdline)){
+					job = getjobpid(ctx->jobs, pid);
+					job->readahead = readahead;
+					if(opts.group){
+						group_join(job, opts.group);
+					}
+				}
+			}
+			else if(job){
+				job->pids[job->nstages++] = pid;
+				job->nlive++;
+			}
+			//a threaded run's other stages are the same process
+			for(k = i + 1; job && k <= last; k++){
+				job->pids[job->nstages++] = pid;
+			}
+			//the parent keeps only the read end the next stage needs
+			if(infd >= 0){
+				close(infd);
+			}
+			if(pfd[1] >= 0){
+				close(pfd[1]);
+			}
+			infd = pfd[0];
+		}
+		pid = pgid;
+		//the job owns the statuses page now, and unmaps it when it's cleared
+		if(job){
+			job->run_status = runst;
+		}
+		else if(runst){
+			munmap(runst, MAXSTAGES * sizeof(int));
+		}
+		//addjob published the first stage only
+		if(job && job->nstages > 1){
+			shm_publish(job);
+		}
+		if(attached){
+			pid = attached->pid;
+		}
+		else if(dd && job){
+			dedup_start(dd, pid);
+		}
+		else if(dd){
+			//never became a job, so nothing will reap it into dedup_done
+			dd->state = DEDUP_DONE;
 		}
 
 		//background jobs
-		else{
-			//still need to add onto jobs list
-			addjob(jobs, pid, BG, cmdline);
+		if(bg){
 			//pid2jid is included, uses formatting to match tshref
 			printf("[%d] (%d) %s", pid2jid(pid), pid, cmdline);
 		}
+		r.builtin = 0;
+		r.pid = pid;
+		r.jid = pid2jid(pid);
+		r.state = BG;
+		ctx->status = 0;
 		//unblock after added job, (need to unblock if pid =/= 0)
 		sigprocmask(SIG_UNBLOCK, &mask, NULL);
 
 		//waitfg so job finishes before next
-		if(!bg){waitfg(pid);}
+		if(!bg){
+			waitfg(pid);
+			//still in the list means it was stopped rather than reaped
+			job = getjobpid(ctx->jobs, pid);
+			r.state = (job && job->state == ST) ? ST : UNDEF;
+			r.status = ctx->status;
+		}
 	}
-	return;
+	//a loadable builtin's exit status, in wait status form like a job's
+	else{
+		r.status = W_EXITCODE(builtin_status, 0);
+	}
+	if(res){*res = r;}
+	return r.status;
 	
 }//end eval
 
-
 /* 
- * parseline - Parse the command line and build the argv array.
- * 
- * Characters enclosed in single quotes are treated as a single
- * argument.  Return true if the user has requested a BG job, false if
- * the user has requested a FG job.  
- */
-int parseline(const char *cmdline, char **argv) {
-	static char array[MAXLINE]; 	/* holds local copy of command line */
-	char *buf = array;         				  /* ptr that traverses command line */
-	char *delim;               					  /* points to first space delimiter */
-	int argc;                  						  /* number of args */
-	int bg;                    						   /* background job? */
-
-	strcpy(buf, cmdline);
-	buf[strlen(buf)-1] = ' ';  				/* replace trailing '\n' with space */
-	while (*buf && (*buf == ' ')) 	  /* ignore leading spaces */
-		buf++;
-
-	/* Build the argv list */
-	argc = 0;
-	if (*buf == '\'') {
-		buf++;
-		delim = strchr(buf, '\'');
-	}
-	else {
-		delim = strchr(buf, ' ');
-	}
-
-	while (delim) {
-		argv[argc++] = buf;
-		*delim = '\0';
-		buf = delim + 1;
-		while (*buf && (*buf == ' ')) /* ignore spaces */
-			buf++;
+* split_pipeline - Cut argv into pipeline stages at each | word
+*
+* Each | is replaced by NULL, so stages[i] is a NULL terminated argv
+* for stage i. Returns the number of stages, or -1 (after an error
+* message) for an empty stage or too many of them.
+*/
+int split_pipeline(char **argv, char ***stages){
+	int i, n;
 
-		if (*buf == '\'') {
-			buf++;
-			delim = strchr(buf, '\'');
+	n = 0;
+	stages[n++] = argv;
+	for(i = 0; argv[i]; i++){
+		if(strcmp(argv[i], "|")){
+			continue;
 		}
-		else {
-			delim = strchr(buf, ' ');
+		argv[i] = NULL;
+		if(stages[n-1][0] == NULL || argv[i+1] == NULL){
+			printf("missing command in pipeline\n");
+			return -1;
 		}
+		if(n == MAXSTAGES){
+			printf("Too many pipeline stages (max %d)\n", MAXSTAGES);
+			return -1;
+		}
+		stages[n++] = &argv[i+1];
 	}
-	argv[argc] = NULL;
-
-	//return 1 for built-in
-	if (argc == 0)  /* ignore blank line */
-	return 1;
-
-	/* should the job run in the background? */
-	if ((bg = (*argv[argc-1] == '&')) != 0) {
-		argv[--argc] = NULL;
-	}
-	return bg;
+	return n;
 }
 
 /* 
-* builtin_cmd - If the user has typed a built-in command then execute
-*    it immediately.  
+* run_stage - Run one command in a freshly forked child; never returns
+*
+* stdin and stdout are already wired to the pipeline. A builtin runs
+* right here, on the child's copy of the shell state, so jobs | wc -l
+* works, and so does a stream builtin (cat, wc, printf) that isn't part
+* of a threaded run; anything else is exec'd.
 */
-int builtin_cmd(char **argv) {
-	//(cs:app page 735)
-	//4 of these;quit, jobs, bg or fg
-	
-	//quit the tsh by exiting
-	if(!strcmp(argv[0], "quit")){
-		exit(0);		//exit does not return
+void run_stage(char **argv, struct launch_opts *opts, sigset_t *mask){
+	const struct stage_builtin *sb;
+	struct stage_io in, out;
+	char **envp;
+	int n, nenv;
+
+	//NAME=value words and @env=clean make the stage's environment: environ (or
+	//nothing) plus those, built here in the child so the shell copies nothing
+	n = env_words(argv);
+	if(n || opts->env_clean){
+		nenv = opts->env_clean ? 0 : env_index()->n;
+		//alloca: it has to outlive this block, up to the exec
+		envp = alloca((nenv + n + 1) * sizeof(char *));
+		make_envp(envp, opts->env_clean ? NULL : environ, argv, n);
+		//scripts and builtins run right here, so they see it as environ too
+		environ = envp;
+		argv += n;
 	}
-	//display the current jobs list by calling jobs (already implemented)
-	if(!strcmp(argv[0], "jobs")){
-		listjobs(jobs);
-		//return 1 for built-in
-		return 1;
+	if(do_redirect(argv) < 0){
+		exit(1);
 	}
-	//bg or fg is handled with do_bgfg
-	if( (!strcmp(argv[0],"bg") || (!strcmp(argv[0], "fg"))) ){
-		do_bgfg(argv);
-		//return 1 for built-in
-		return 1;
-	}	
+	//per-job limits go in before execve, so the kernel enforces them from the first instruction
+	apply_rlimits(opts);
+	//unblock in child fork
+	sigprocmask(SIG_UNBLOCK, mask, NULL);
 
-	return 0;     /* not a builtin command */
+	if(argv[0] == NULL){
+		exit(0);
+	}
+	if(builtin_cmd(argv)){
+		exit(builtin_status);
+	}
+	//a stream builtin on the stage's own stdin and stdout
+	if((sb = find_stage_builtin(argv[0])) != NULL){
+		stage_signals();
+		memset(&in, 0, sizeof(in));
+		memset(&out, 0, sizeof(out));
+		in.fd = STDIN_FILENO;
+		out.fd = STDOUT_FILENO;
+		n = sb->run(argv, &in, &out);
+		exit(sio_end_write(&out) < 0 && n == 0 ? 1 : n);
+	}
+	//returns an error message and quits process if not applicable cmd(execve returned for error)
+	execve(argv[0], argv, environ);
+	//a text file without #! is a tsh script: run it right here rather than via /bin/sh
+	if(errno == ENOEXEC){
+		run_script_child(argv[0]);
+	}
+	printf("%s: Command not found.\n", argv[0]);
+	//127, as sh uses, so pipefail and pipestatus see the failure
+	exit(127);
 }
 
-
 /* 
-* do_redirect - scans argv for any use of < or > which indicate input or output redirection
+* thread_run - The last stage of the threaded run that starts at stage i
 *
+* Two or more adjacent stream builtins (cat, wc, printf) with no
+* redirections of their own run as threads of one child, joined by
+* in-memory rings instead of kernel pipes. Returns i when stage i
+* starts no such run. set +o pipethreads turns this off.
 */
-void do_redirect(char **argv){
-	int i;
+int thread_run(char ***stages, int i, int nstages){
+	int j;
 
-	for(i=0; argv[i]; i++){
-		if (!strcmp(argv[i],"<")) {
-			/* add code for input redirection below */
-			int fdin = open(argv[i+1], O_RDONLY, 0);
-				//error handling
-			if(fdin < 0){
-				perror("open");
-				return;
-			}
-			//STDIN_FILENO is in header <unistd.h> -- cs:app 863
-			dup2(fdin, STDIN_FILENO);
-			//error handling
-			if(close(fdin) < 0){
-				perror("close");
-				return;
-			}
-			
-			/* the line below cuts argv short -- this removes the < and whatever follows from argv */
-			argv[i]=NULL;
+	if(ctx->nothreads){
+		return i;
+	}
+	for(j = i; j < nstages && find_stage_builtin(stages[j][0]) && !has_redir(stages[j]); j++)
+		;
+	return (j - 1 > i) ? j - 1 : i;
+}
+
+/* 
+* run_threads - Run n stream builtin stages in this forked child; never returns
+*
+* Each stage gets a thread, the last one this one, and stage k writes
+* into a ring stage k+1 reads. Only the run's ends are real fds: 0 and
+* 1, already wired to the rest of the pipeline. Each stage's exit code
+* goes in codes[k] (shared with the shell, which reports them per
+* stage); the child exits with the last stage's, or with pipefail the
+* rightmost failed one's, for when codes is NULL.
+*/
+void run_threads(char ***stages, int n, int *codes, struct launch_opts *opts, sigset_t *mask){
+	struct stage_thread *t;
+	struct spsc_ring *rings;
+	sigset_t all, prev;
+	int k;
+
+	apply_rlimits(opts);
+	stage_signals();
+	sigprocmask(SIG_UNBLOCK, mask, NULL);
+
+	t = calloc(n, sizeof(*t));
+	rings = calloc(n - 1, sizeof(*rings));
+	if(t == NULL || rings == NULL){
+		fprintf(stderr, "pipeline: %s\n", strerror(errno));
+		exit(1);
+	}
+	for(k = 0; k < n; k++){
+		t[k].argv = stages[k];
+		t[k].sb = find_stage_builtin(stages[k][0]);
+		t[k].in.fd = (k == 0) ? STDIN_FILENO : -1;
+		t[k].in.ring = (k == 0) ? NULL : &rings[k - 1];
+		t[k].out.fd = (k == n - 1) ? STDOUT_FILENO : -1;
+		t[k].out.ring = (k == n - 1) ? NULL : &rings[k];
+	}
+	//signals (ctrl-c, SIGPIPE from the real stdout) are this thread's to take
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &prev);
+	for(k = 0; k < n - 1; k++){
+		if((errno = pthread_create(&t[k].tid, NULL, stage_thread_main, &t[k])) != 0){
+			fprintf(stderr, "pipeline: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &prev, NULL);
+	stage_thread_main(&t[n - 1]);
+	for(k = 0; k < n - 1; k++){
+		pthread_join(t[k].tid, NULL);
+	}
+
+	for(k = 0; codes && k < n; k++){
+		codes[k] = t[k].status;
+	}
+	for(k = n - 1; ctx->pipefail && k > 0 && t[k].status == 0; k--)
+		;
+	exit(t[k].status);
+}
+
+/* stage_thread_main - Run one stage of a threaded run, then close its ends */
+void *stage_thread_main(void *arg){
+	struct stage_thread *t = arg;
+
+	t->status = t->sb->run(t->argv, &t->in, &t->out);
+	if(sio_end_write(&t->out) < 0 && t->status == 0){
+		t->status = 1;
+	}
+	//an upstream stage still writing gets EPIPE now
+	sio_end_read(&t->in);
+	return NULL;
+}
+
+/* stage_signals - Give a stream builtin the signal handling exec would have */
+void stage_signals(void){
+	Signal(SIGINT, SIG_DFL);
+	Signal(SIGTSTP, SIG_DFL);
+	Signal(SIGCHLD, SIG_DFL);
+	Signal(SIGQUIT, SIG_DFL);
+}
+
+/* has_redir - Does argv have any redirection words? */
+int has_redir(char **argv){
+	struct redir rd;
+	int i;
+
+	for(i = 0; argv[i]; i++){
+		if(parse_redir(argv, i, &rd) > 0){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* find_stage_builtin - Look up a stream builtin by name, NULL if name isn't one */
+const struct stage_builtin *find_stage_builtin(const char *name){
+	int i;
+
+	for(i = 0; name && stage_builtins[i].name; i++){
+		if(!strcmp(stage_builtins[i].name, name)){
+			return &stage_builtins[i];
+		}
+	}
+	return NULL;
+}
+
+/* 
+* ring_sleep - Wait on r until the other end moves or closes
+*
+* Called with the ring empty (reader) or full (writer). waiting is
+* raised before seq is sampled and the condition rechecked, and ring_wake
+* bumps seq before it looks at waiting, so a wakeup can't fall between.
+*/
+void ring_sleep(struct spsc_ring *r, int writer){
+	unsigned seen;
+	size_t used;
+
+	__atomic_add_fetch(&r->waiting, 1, __ATOMIC_SEQ_CST);
+	seen = __atomic_load_n(&r->seq, __ATOMIC_SEQ_CST);
+	used = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) - __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+	if(writer ? (used == RINGSIZE && !__atomic_load_n(&r->rclosed, __ATOMIC_SEQ_CST))
+	          : (used == 0 && !__atomic_load_n(&r->wclosed, __ATOMIC_SEQ_CST))){
+		syscall(SYS_futex, &r->seq, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+	}
+	__atomic_sub_fetch(&r->waiting, 1, __ATOMIC_SEQ_CST);
+}
+
+/* ring_wake - Tell the other end of r that this one moved or closed */
+void ring_wake(struct spsc_ring *r){
+	__atomic_add_fetch(&r->seq, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST)){
+		syscall(SYS_futex, &r->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+	}
+}
+
+/* 
+* ring_read - Read up to n bytes from r, blocking while it's empty
+*
+* Returns the bytes read, or 0 once the writer is done and r is drained.
+*/
+ssize_t ring_read(struct spsc_ring *r, char *p, size_t n){
+	size_t head, tail, at, chunk;
+
+	tail = r->tail;
+	while((head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) == tail){
+		if(__atomic_load_n(&r->wclosed, __ATOMIC_ACQUIRE)){
+			//its last bytes went in before it closed
+			if(__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail){
+				return 0;
+			}
+			continue;
+		}
+		ring_sleep(r, 0);
+	}
+	n = (head - tail < n) ? head - tail : n;
+	at = tail % RINGSIZE;
+	chunk = (RINGSIZE - at < n) ? RINGSIZE - at : n;
+	memcpy(p, r->buf + at, chunk);
+	memcpy(p + chunk, r->buf, n - chunk);
+	__atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+	ring_wake(r);
+	return n;
+}
+
+/* 
+* ring_write - Write all n bytes into r, blocking while it's full
+*
+* Returns n, or -1 with errno EPIPE once the reader has stopped reading.
+*/
+ssize_t ring_write(struct spsc_ring *r, const char *p, size_t n){
+	size_t head, tail, at, chunk, done;
+
+	head = r->head;
+	for(done = 0; done < n; ){
+		if(__atomic_load_n(&r->rclosed, __ATOMIC_ACQUIRE)){
+			errno = EPIPE;
+			return -1;
+		}
+		tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if(head - tail == RINGSIZE){
+			ring_sleep(r, 1);
+			continue;
+		}
+		chunk = RINGSIZE - (head - tail);
+		chunk = (n - done < chunk) ? n - done : chunk;
+		at = head % RINGSIZE;
+		if(RINGSIZE - at < chunk){
+			chunk = RINGSIZE - at;
+		}
+		memcpy(r->buf + at, p + done, chunk);
+		head += chunk;
+		done += chunk;
+		__atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+		ring_wake(r);
+	}
+	return n;
+}
+
+/* sio_read - Read up to n bytes of a stage's input; 0 at its end, -1 on error */
+ssize_t sio_read(struct stage_io *io, char *p, size_t n){
+	ssize_t got;
+
+	if(io->ring){
+		return ring_read(io->ring, p, n);
+	}
+	while((got = read(io->fd, p, n)) < 0 && errno == EINTR)
+		;
+	return got;
+}
+
+/* 
+* sio_write - Add n bytes to a stage's output
+*
+* Small writes collect in io->buf; a write bigger than it goes straight
+* through. Returns -1 (errno set) if the output is gone.
+*/
+int sio_write(struct stage_io *io, const char *p, size_t n){
+	if(io->len + n > STAGEBUF && sio_flush(io) < 0){
+		return -1;
+	}
+	if(n >= STAGEBUF){
+		return sio_put(io, p, n);
+	}
+	memcpy(io->buf + io->len, p, n);
+	io->len += n;
+	return 0;
+}
+
+/* sio_flush - Write out what a stage's output has buffered */
+int sio_flush(struct stage_io *io){
+	size_t len = io->len;
+
+	io->len = 0;
+	return (len == 0) ? 0 : sio_put(io, io->buf, len);
+}
+
+/* sio_put - Write n bytes to a stage's output now, all of them or -1 */
+int sio_put(struct stage_io *io, const char *p, size_t n){
+	ssize_t w;
+
+	if(io->ring){
+		return (ring_write(io->ring, p, n) < 0) ? -1 : 0;
+	}
+	for( ; n > 0; p += w, n -= w){
+		if((w = write(io->fd, p, n)) < 0){
+			if(errno != EINTR){
+				return -1;
+			}
+			w = 0;
+		}
+	}
+	return 0;
+}
+
+/* sio_end_write - A stage is done writing: flush, and let a ring's reader see the end */
+int sio_end_write(struct stage_io *io){
+	int r = sio_flush(io);
+
+	if(io->ring){
+		__atomic_store_n(&io->ring->wclosed, 1, __ATOMIC_RELEASE);
+		ring_wake(io->ring);
+	}
+	return r;
+}
+
+/* sio_end_read - A stage reads no more: a ring's writer gets EPIPE from now on */
+void sio_end_read(struct stage_io *io){
+	if(io->ring){
+		__atomic_store_n(&io->ring->rclosed, 1, __ATOMIC_RELEASE);
+		ring_wake(io->ring);
+	}
+}
+
+/* 
+* stage_cat - The cat builtin: copy each FILE (- or none for stdin) to stdout
+*/
+int stage_cat(char **argv, struct stage_io *in, struct stage_io *out){
+	struct stage_io file;
+	struct stage_io *src;
+	char buf[RINGSIZE];
+	const char *name;
+	ssize_t n;
+	int i, status = 0;
+
+	for(i = 1; i == 1 || argv[i]; i++){
+		name = argv[i] ? argv[i] : "-";
+		src = in;
+		if(strcmp(name, "-")){
+			file.ring = NULL;
+			if((file.fd = open(name, O_RDONLY|O_CLOEXEC)) < 0){
+				fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+				status = 1;
+				continue;
+			}
+			src = &file;
+		}
+		while((n = sio_read(src, buf, sizeof(buf))) > 0){
+			if(sio_write(out, buf, n) < 0){
+				status = 1;
+				break;
+			}
+		}
+		if(n < 0){
+			fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+			status = 1;
+		}
+		if(src == &file){
+			close(file.fd);
+		}
+		if(argv[i] == NULL){
+			break;
+		}
+	}
+	return status;
+}
+
+/* 
+* stage_wc - The wc builtin: count stdin's lines (-l), words (-w) and bytes (-c)
+*
+* With no option, all three.
+*/
+int stage_wc(char **argv, struct stage_io *in, struct stage_io *out){
+	char buf[RINGSIZE], line[80];
+	long long lines = 0, words = 0, bytes = 0;
+	int i, inword = 0, l = 0, w = 0, c = 0, len;
+	const char *p, *q;
+	ssize_t n, k;
+
+	for(i = 1; argv[i]; i++){
+		p = argv[i] + 1;
+		if(argv[i][0] != '-' || *p == '\0' || strspn(p, "lwc") != strlen(p)){
+			fprintf(stderr, "usage: wc [-lwc]\n");
+			return 2;
+		}
+		l |= (strchr(p, 'l') != NULL);
+		w |= (strchr(p, 'w') != NULL);
+		c |= (strchr(p, 'c') != NULL);
+	}
+	if(!l && !w && !c){
+		l = w = c = 1;
+	}
+
+	while((n = sio_read(in, buf, sizeof(buf))) > 0){
+		bytes += n;
+		//lines alone need no look at every byte
+		for(q = buf; !w && (q = memchr(q, '\n', buf + n - q)) != NULL; q++){
+			lines++;
+		}
+		for(k = 0; w && k < n; k++){
+			lines += (buf[k] == '\n');
+			if(isspace((unsigned char)buf[k])){
+				inword = 0;
+			}
+			else if(!inword){
+				inword = 1;
+				words++;
+			}
+		}
+	}
+	if(n < 0){
+		fprintf(stderr, "wc: %s\n", strerror(errno));
+		return 1;
+	}
+	//one count alone is printed bare, several in columns
+	len = 0;
+	if(l){
+		len += snprintf(line + len, sizeof(line) - len, (w || c) ? "%7lld " : "%lld ", lines);
+	}
+	if(w){
+		len += snprintf(line + len, sizeof(line) - len, (l || c) ? "%7lld " : "%lld ", words);
+	}
+	if(c){
+		len += snprintf(line + len, sizeof(line) - len, (l || w) ? "%7lld " : "%lld ", bytes);
+	}
+	line[len - 1] = '\n';
+	return (sio_write(out, line, len) < 0) ? 1 : 0;
+}
+
+/* 
+* stage_printf - The printf builtin: printf FORMAT [ARG...]
+*
+* FORMAT takes the escapes \n \t \r \\ \a \b \f \v and the conversions
+* %s %c %d %i %u %o %x %X %% (with flags, width and precision). Like
+* printf(1), it is reused until the arguments run out; a missing
+* argument counts as "" or 0.
+*/
+int stage_printf(char **argv, struct stage_io *in, struct stage_io *out){
+	char spec[32], text[MAXLINE + 64], one[2] = "", c, conv, *p;
+	const char *f, *arg;
+	char **next;
+	size_t size;
+	int k, n, used, err;
+
+	(void)in;
+	if(argv[1] == NULL){
+		fprintf(stderr, "usage: printf FORMAT [ARG...]\n");
+		return 2;
+	}
+	next = argv + 2;
+	do{
+		used = 0;
+		for(f = argv[1]; *f; f++){
+			if(*f == '\\' && f[1]){
+				f++;
+				c = (*f == 'n') ? '\n' : (*f == 't') ? '\t' : (*f == 'r') ? '\r' : (*f == 'a') ? '\a' :
+				    (*f == 'b') ? '\b' : (*f == 'f') ? '\f' : (*f == 'v') ? '\v' : *f;
+				//an unknown escape keeps its backslash
+				if(c == *f && c != '\\' && sio_write(out, "\\", 1) < 0){
+					return 1;
+				}
+				if(sio_write(out, &c, 1) < 0){
+					return 1;
+				}
+				continue;
+			}
+			if(*f != '%' || f[1] == '%' || f[1] == '\0'){
+				f += (*f == '%' && f[1] == '%');
+				if(sio_write(out, f, 1) < 0){
+					return 1;
+				}
+				continue;
+			}
+			//flags, width and precision go through to snprintf as they are
+			k = 0;
+			spec[k++] = '%';
+			while(f[1] && strchr("-+ #0123456789.", f[1]) && k < 16){
+				spec[k++] = *++f;
+			}
+			if(*++f == '\0'){
+				fprintf(stderr, "printf: missing conversion\n");
+				return 1;
+			}
+			arg = *next ? *next++ : "";
+			used = 1;
+			if(!strchr("scdiuoxX", *f)){
+				fprintf(stderr, "printf: %%%c: invalid conversion\n", *f);
+				return 1;
+			}
+			//%c as a one character string, so %c of "" pads but prints no NUL; the integers as long longs
+			conv = (*f == 'c') ? 's' : (*f == 'i') ? 'd' : *f;
+			if(*f == 'c'){
+				one[0] = *arg;
+				arg = one;
+			}
+			if(conv != 's'){
+				spec[k++] = 'l';
+				spec[k++] = 'l';
+			}
+			spec[k++] = conv;
+			spec[k] = '\0';
+			//one that doesn't fit text (a long argument, a wide field) is formatted again into a buffer that does
+			for(p = text, size = sizeof(text); ; ){
+				n = (conv == 's') ? snprintf(p, size, spec, arg) :
+				    (conv == 'd') ? snprintf(p, size, spec, strtoll(arg, NULL, 0)) :
+				    snprintf(p, size, spec, strtoull(arg, NULL, 0));
+				if(n < 0 || (size_t)n < size){
+					break;
+				}
+				if((p = malloc(n + 1)) == NULL){
+					fprintf(stderr, "printf: %s\n", strerror(ENOMEM));
+					return 1;
+				}
+				size = n + 1;
+			}
+			if(n < 0){
+				fprintf(stderr, "printf: %s: %s\n", spec, strerror(errno));
+			}
+			err = (n < 0 || (n > 0 && sio_write(out, p, n) < 0));
+			if(p != text){
+				free(p);
+			}
+			if(err){
+				return 1;
+			}
+		}
+	}while(used && *next);
+	return 0;
+}
+
+/* 
+* env_words - How many NAME=value assignments argv starts with
+*/
+int env_words(char **argv){
+	char *p;
+	int n;
+
+	for(n = 0; argv[n]; n++){
+		p = argv[n];
+		if(!isalpha(*p) && *p != '_'){
+			break;
+		}
+		while(isalnum(*p) || *p == '_'){
+			p++;
+		}
+		if(*p != '='){
+			break;
+		}
+	}
+	return n;
+}
+
+/* 
+* make_envp - Fill envp with base (environ, or NULL for none) overlaid
+*    with the n NAME=value words in delta; envp needs room for both and the NULL
+*
+* Only pointers are copied: the strings stay where they are. A word that
+* replaces a variable takes its place, found through env_index; one that
+* adds a variable goes after them, the later of two for one name winning.
+*/
+void make_envp(char **envp, char **base, char **delta, int n){
+	struct env_index *ix = NULL;
+	int i, k, j = 0, pos;
+	size_t len;
+
+	if(base){
+		ix = env_index();
+		memcpy(envp, ix->base, ix->n * sizeof(char *));
+		j = ix->n;
+	}
+	for(k = 0; k < n; k++){
+		len = strchr(delta[k], '=') - delta[k];
+		if(ix && (pos = env_find(ix, delta[k], len)) >= 0){
+			envp[pos] = delta[k];
+			continue;
+		}
+		//only the few added ones are scanned for a repeat
+		for(i = ix ? ix->n : 0; i < j && strncmp(envp[i], delta[k], len + 1); i++)
+			;
+		envp[i] = delta[k];
+		j += (i == j);
+	}
+	envp[j] = NULL;
+}
+
+/* 
+* env_index - The index of environ, (re)built if it's stale
+*
+* Besides env_changed, an environ that moved or whose length no longer
+* matches counts as stale, which catches a change made behind our back.
+*/
+struct env_index *env_index(void){
+	struct env_index *ix = &envidx;
+	int i, n, size, *slot;
+	unsigned h;
+
+	if(ix->valid && ix->base == environ && environ[ix->n] == NULL && (ix->n == 0 || environ[ix->n - 1])){
+		return ix;
+	}
+	for(n = 0; environ[n]; n++)
+		;
+	for(size = 16; size < 2 * n; size *= 2)
+		;
+	if(size != ix->size){
+		//on failure there is no index and every lookup misses
+		if((slot = realloc(ix->slot, size * sizeof(int))) == NULL){
+			size = 0;
+		}
+		ix->slot = slot;
+		ix->size = size;
+	}
+	if(ix->size){
+		memset(ix->slot, 0, ix->size * sizeof(int));
+	}
+	for(i = 0; ix->size && i < n; i++){
+		for(h = fnv1a_n(environ[i], strcspn(environ[i], "=")); ix->slot[h & (ix->size - 1)]; h++)
+			;
+		ix->slot[h & (ix->size - 1)] = i + 1;
+	}
+	ix->base = environ;
+	ix->n = n;
+	ix->valid = 1;
+	return ix;
+}
+
+/* env_find - Position in ix->base of the variable named by name's first len bytes, or -1 */
+int env_find(struct env_index *ix, const char *name, size_t len){
+	unsigned h;
+	int i;
+
+	for(h = fnv1a_n(name, len); ix->size && (i = ix->slot[h & (ix->size - 1)]); h++){
+		if(!strncmp(ix->base[i - 1], name, len) && ix->base[i - 1][len] == '='){
+			return i - 1;
+		}
+	}
+	return -1;
+}
+
+/* env_changed - Mark the environ index stale after a setenv or unsetenv */
+void env_changed(void){
+	envidx.valid = 0;
+}
+
+/* 
+* stdin_redirected - Does argv redirect fd 0 (< file, 0<&N, ...)?
+*/
+int stdin_redirected(char **argv){
+	struct redir rd;
+	int i, n;
+
+	for(i = 0; argv[i]; i += (n > 0) ? n : 1){
+		if((n = parse_redir(argv, i, &rd)) > 0 && rd.fd == STDIN_FILENO){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/* 
+ * parseline - Parse the command line and build the argv array.
+ * 
+ * The command line is copied into buf, which argv then points into,
+ * so each caller owns its parse and nested evals don't clobber it.
+ * 
+ * Characters enclosed in single quotes are treated as a single
+ * argument.  Return true if the user has requested a BG job, false if
+ * the user has requested a FG job.  
+ *
+ * Every character is looked at once, so parse time is linear in the
+ * line length whatever it contains. Lines need not end in a newline.
+ * A line longer than MAXLINE-2 characters (not counting the newline),
+ * or with more than MAXARGS-1 words, is rejected (argv[0] is NULL)
+ * rather than cut short or overrunning argv.
+ */
+int parseline(const char *cmdline, char *buf, char **argv) {
+	/* buf holds the caller's copy of the command line (MAXLINE bytes) and
+	   is the ptr that traverses it; argv points into it afterwards */
+	size_t len;                					  /* bytes copied */
+	int argc;                  						  /* number of args */
+	int bg;                    						   /* background job? */
+
+	len = strnlen(cmdline, MAXLINE);
+	if (len > 0 && cmdline[len-1] == '\n')  	/* drop the trailing '\n', if there is one */
+		len--;
+	//what's left of a line cut short is a different command; don't run it
+	if (len > MAXLINE - 2) {
+		printf("Line too long (max %d characters)\n", MAXLINE - 2);
+		argv[0] = NULL;
+		return 1;
+	}
+	memcpy(buf, cmdline, len);
+	buf[len] = '\0';
+
+	/* Build the argv list */
+	argc = 0;
+	while (1) {
+		while (*buf == ' ')  	 	  /* ignore spaces */
+			buf++;
+		if (*buf == '\0')
+			break;
+		//argv needs room for the NULL; running the line cut short would be worse than not at all
+		if (argc == MAXARGS - 1) {
+			printf("Too many arguments (max %d)\n", MAXARGS - 1);
+			argv[0] = NULL;
+			return 1;
+		}
+		if (*buf == '\'') {
+			/* quoted: runs to the closing quote, or the end of the line */
+			argv[argc++] = ++buf;
+			while (*buf && *buf != '\'')
+				buf++;
+		}
+		else {
+			argv[argc++] = buf;
+			while (*buf && *buf != ' ')
+				buf++;
+		}
+		if (*buf)
+			*buf++ = '\0';
+	}
+	argv[argc] = NULL;
+
+	//return 1 for built-in
+	if (argc == 0)  /* ignore blank line */
+	return 1;
+
+	/* should the job run in the background? */
+	if ((bg = (*argv[argc-1] == '&')) != 0) {
+		argv[--argc] = NULL;
+	}
+	return bg;
+}
+
+/* 
+* builtin_cmd - If the user has typed a built-in command then execute
+*    it immediately.  
+*/
+int builtin_cmd(char **argv) {
+	//(cs:app page 735)
+	//4 of these;quit, jobs, bg or fg
+	struct plugin *pl;
+	char *eq;
+	int i, n;
+
+	builtin_status = 0;
+	//NAME=value words with no command set the shell's own environment, for every later job
+	if((n = env_words(argv)) > 0 && argv[n] == NULL){
+		for(i = 0; i < n; i++){
+			eq = strchr(argv[i], '=');
+			*eq = '\0';
+			setenv(argv[i], eq + 1, 1);
+			*eq = '=';
+		}
+		env_changed();
+		return 1;
+	}
+	//quit the tsh by exiting
+	if(!strcmp(argv[0], "quit")){
+		shell_exit(0);		//exit does not return
+	}
+	//run a script in this shell, no fork
+	if(!strcmp(argv[0], "source") || !strcmp(argv[0], ".")){
+		if(argv[1] == NULL){
+			printf("%s command requires a file argument\n", argv[0]);
+		}
+		else if(source_file(argv[1]) == -1){
+			printf("%s: %s\n", argv[1], strerror(errno));
+		}
+		return 1;
+	}
+	//redirect the shell's own fds, or replace the shell with a command
+	if(!strcmp(argv[0], "exec")){
+		do_exec(argv);
+		return 1;
+	}
+	//hand a job over to the per-user registry, or take detached jobs back
+	if(!strcmp(argv[0], "detach")){
+		do_detach(argv);
+		return 1;
+	}
+	if(!strcmp(argv[0], "attach")){
+		do_attach(argv);
+		return 1;
+	}
+	//hash files in parallel, sha256sum style output
+	if(!strcmp(argv[0], "checksum")){
+		do_checksum(argv);
+		return 1;
+	}
+	//list a directory tree on a pool of threads, find style
+	if(!strcmp(argv[0], "walk")){
+		do_walk(argv);
+		return 1;
+	}
+	//start many copies of a command from a pool of spawner threads
+	if(!strcmp(argv[0], "spawn")){
+		do_spawn(argv);
+		return 1;
+	}
+	//time commands over many runs
+	if(!strcmp(argv[0], "bench")){
+		do_bench(argv);
+		return 1;
+	}
+	//add to / run a work queue shared with other shells
+	if(!strcmp(argv[0], "enqueue")){
+		do_enqueue(argv);
+		return 1;
+	}
+	if(!strcmp(argv[0], "drain")){
+		do_drain(argv);
+		return 1;
+	}
+	//per-command timing percentiles from the timing log
+	if(!strcmp(argv[0], "slowest")){
+		do_slowest(argv);
+		return 1;
+	}
+	//replace the shell binary, keeping its jobs
+	if(!strcmp(argv[0], "reexec")){
+		do_reexec(argv);
+		return 1;
+	}
+	//set, clear or list signal traps
+	if(!strcmp(argv[0], "trap")){
+		do_trap(argv);
+		return 1;
+	}
+	//set the prompt string, e.g. prompt 'my> ' (quote it to keep the space)
+	if(!strcmp(argv[0], "prompt")){
+		if(argv[1] == NULL){
+			printf("prompt command requires a string argument\n");
+		}
+		else{
+			snprintf(prompt, MAXLINE, "%s", argv[1]);
+		}
+		return 1;
+	}
+	//show or change the shell's own resource limits (inherited by every job)
+	if(!strcmp(argv[0], "ulimit")){
+		do_ulimit(argv);
+		return 1;
+	}
+	//pipeline options, and the last foreground pipeline's per-stage statuses
+	if(!strcmp(argv[0], "set")){
+		do_set(argv);
+		return 1;
+	}
+	if(!strcmp(argv[0], "pipestatus")){
+		do_pipestatus(argv);
+		return 1;
+	}
+	//display the current jobs list by calling jobs (already implemented)
+	if(!strcmp(argv[0], "jobs")){
+		listjobs(ctx->jobs);
+		//then each group as a whole
+		list_groups();
+		//return 1 for built-in
+		return 1;
+	}
+	//bg or fg is handled with do_bgfg
+	if( (!strcmp(argv[0],"bg") || (!strcmp(argv[0], "fg"))) ){
+		do_bgfg(argv);
+		//return 1 for built-in
+		return 1;
+	}	
+	//job groups, and signalling or waiting for jobs (and groups)
+	if(!strcmp(argv[0], "group")){
+		do_group(argv);
+		return 1;
+	}
+	if(!strcmp(argv[0], "kill")){
+		do_kill(argv);
+		return 1;
+	}
+	if(!strcmp(argv[0], "wait")){
+		do_wait(argv);
+		return 1;
+	}
+	//add or list loadable builtins
+	if(!strcmp(argv[0], "enable")){
+		do_enable(argv);
+		return 1;
+	}
+	//a loadable builtin runs in our process, after the built in ones so it can't shadow them
+	if((pl = find_plugin(argv[0])) != NULL){
+		builtin_status = run_plugin(pl, argv);
+		return 1;
+	}
+
+	return 0;     /* not a builtin command */
+}
+
+
+/* 
+* do_redirect - scans argv for redirections and applies them to this process
+*
+* Understands < file, > file, >> file, N< file, N> file, N>> file, and
+* the dup forms >&N, N>&M, <&N and N>&- (close). The target may be
+* glued on (3>>log) or the next word (3>> log). Redirection words are
+* removed from argv. Children call this before execve; the exec builtin
+* calls it on the shell itself. Returns -1 (after an error message) if
+* a redirection failed.
+*/
+int do_redirect(char **argv){
+	int i, j, n;
+	struct redir rd;
+
+	for(i = j = 0; argv[i]; i += n){
+		n = parse_redir(argv, i, &rd);
+		if(n == 0){
+			//not a redirection, keep the word
+			argv[j++] = argv[i];
+			n = 1;
+			continue;
+		}
+		if(n < 0){
+			printf("%s: missing redirection target\n", argv[i]);
+			return -1;
+		}
+		if(apply_redir(&rd) < 0){
+			return -1;
+		}
+	}
+	argv[j] = NULL;
+	return 0;
+}
+
+/* 
+* parse_redir - Decode the redirection starting at argv[i] into rd
+*
+* Returns the number of words it used (1 or 2), 0 if argv[i] isn't a
+* redirection, or -1 if it is one but has no target.
+*/
+int parse_redir(char **argv, int i, struct redir *rd){
+	char *p = argv[i];
+	char *target;
+	int used = 1;
+
+	rd->fd = -1;
+	if(isdigit(*p)){
+		rd->fd = strtol(p, &p, 10);
+	}
+	if(*p == '<'){
+		rd->fd = (rd->fd < 0) ? STDIN_FILENO : rd->fd;
+		rd->flags = O_RDONLY;
+		p++;
+	}
+	else if(*p == '>'){
+		rd->fd = (rd->fd < 0) ? STDOUT_FILENO : rd->fd;
+		rd->flags = O_WRONLY|O_CREAT|O_TRUNC;
+		p++;
+		if(*p == '>'){
+			rd->flags = O_WRONLY|O_CREAT|O_APPEND;
+			p++;
+		}
+	}
+	else{
+		return 0;
+	}
+
+	//>&N and <&N duplicate an fd that is already open instead of opening a file
+	rd->path = NULL;
+	rd->dupfd = -2;
+	if(*p == '&'){
+		p++;
+		rd->flags = -1;
+	}
+	target = p;
+	if(*target == '\0'){
+		if((target = argv[i+1]) == NULL){
+			return -1;
+		}
+		used = 2;
+	}
+	if(rd->flags != -1){
+		rd->path = target;
+	}
+	else if(!strcmp(target, "-")){
+		rd->dupfd = -1;
+	}
+	else if(isdigit(*target)){
+		rd->dupfd = atoi(target);
+	}
+	else{
+		return -1;
+	}
+	return used;
+}
+
+/* 
+* apply_redir - Make rd->fd refer to rd's file (or fd) in this process
+*/
+int apply_redir(struct redir *rd){
+	int fd;
+
+	//N>&- just closes N
+	if(rd->flags == -1 && rd->dupfd == -1){
+		close(rd->fd);
+		return 0;
+	}
+	//an fd opened earlier (say by exec 3>>log) is reused with a dup, no open/close pair
+	if(rd->flags == -1){
+		if(rd->fd == STDIN_FILENO){
+			ctx->stdin_moved = 1;
+		}
+		if(rd->dupfd != rd->fd && dup2(rd->dupfd, rd->fd) < 0){
+			perror("dup2");
+			return -1;
+		}
+		return 0;
+	}
+
+	//exec <file: the input loop has to drop what it buffered from the old stdin
+	if(rd->fd == STDIN_FILENO){
+		ctx->stdin_moved = 1;
+	}
+	fd = open(rd->path, rd->flags, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+	//error handling
+	if(fd < 0){
+		perror(rd->path);
+		return -1;
+	}
+	if(fd != rd->fd){
+		//STDIN_FILENO etc. are in header <unistd.h> -- cs:app 863
+		if(dup2(fd, rd->fd) < 0){
+			perror("dup2");
+			close(fd);
+			return -1;
+		}
+		//error handling
+		if(close(fd) < 0){
+			perror("close");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* 
+* fd_high - Move one of the shell's own fds to SHELLFD or above
+*
+* Keeps the low numbers for the user, so exec 3>>log never lands on the
+* wakeup eventfd or the like. Returns the new fd (fd itself if it can't
+* be moved), close-on-exec either way; passes a negative fd through.
+*/
+int fd_high(int fd){
+	int nfd;
+
+	if(fd < 0 || fd >= SHELLFD || (nfd = fcntl(fd, F_DUPFD_CLOEXEC, SHELLFD)) < 0){
+		return fd;
+	}
+	close(fd);
+	return nfd;
+}
+
+/* shell_fd - Is fd one the shell keeps for itself? */
+int shell_fd(int fd){
+	int i;
+
+	if(fd == ctx->wakefd || fd == ctx->timingfd || fd == recfd){
+		return 1;
+	}
+	if(input_loop && (fd == input_loop->epfd || fd == input_loop->ringfd)){
+		return 1;
+	}
+	for(i = 0; i < MAXJOBS; i++){
+		if(ctx->jobs[i].pidfd >= 0 && fd == ctx->jobs[i].pidfd){
+			return 1;
+		}
+		if(dedup_ents[i].state != DEDUP_FREE && fd == dedup_ents[i].memfd){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* 
+* do_exec - Execute the builtin exec command
+*
+* exec REDIRECTIONS           apply them to the shell for good, so later
+*                             commands inherit the fds (exec 3>>log)
+* exec cmd args REDIRECTIONS  replace the shell with cmd
+*/
+void do_exec(char **argv){
+	struct redir rd;
+	int i, n;
+
+	//the shell's own fds (the wakeup eventfd, epoll, logs) aren't the user's to replace
+	for(i = 1; argv[i]; i += n){
+		if((n = parse_redir(argv, i, &rd)) <= 0){
+			n = 1;
+			continue;
+		}
+		if(shell_fd(rd.fd)){
+			printf("exec: fd %d is in use by the shell\n", rd.fd);
+			return;
+		}
+	}
+	//what the shell has buffered (a batch of "[1] (pid)" lines) belongs on the
+	//stdout it was written for, and execve would throw it away
+	fflush(stdout);
+	//redirections are applied to the shell itself
+	if(do_redirect(argv + 1) < 0){
+		return;
+	}
+	if(argv[1] == NULL){
+		return;
+	}
+	execve(argv[1], argv + 1, environ);
+	printf("%s: Command not found.\n", argv[1]);
+}
+
+/* 
+* parse_launch_opts - Pull leading @key=value words out of argv into opts
+*
+* Known are @rlimit=name:value[,name:value...], with name one of core,
+* nofile, cpu, nproc or as, and value a count, a byte size with an
+* optional K/M/G suffix, or "unlimited"; @dedup; @env=clean, for an
+* environment of just the command's NAME=value words; and @group=NAME,
+* to join a group made with group create. The option words
+* are removed from argv. Returns -1 (after printing why) on a bad option.
+*/
+int parse_launch_opts(char **argv, struct launch_opts *opts){
+	int i, n, k;
+	char *item, *colon, *save;
+	char spec[MAXLINE];
+
+	opts->nrlimits = 0;
+	opts->dedup = 0;
+	opts->env_clean = 0;
+	opts->group = NULL;
+
+	for(n = 0; argv[n] && argv[n][0] == '@'; n++){
+		if(!strcmp(argv[n], "@dedup")){
+			opts->dedup = 1;
+			continue;
+		}
+		if(!strcmp(argv[n], "@env=clean")){
+			opts->env_clean = 1;
+			continue;
+		}
+		if(!strncmp(argv[n], "@group=", 7)){
+			if((opts->group = find_group(argv[n] + 7)) == NULL){
+				printf("%s: no such group (group create %s)\n", argv[n] + 7, argv[n] + 7);
+				return -1;
+			}
+			continue;
+		}
+		if(strncmp(argv[n], "@rlimit=", 8)){
+			printf("%s: unknown launch option\n", argv[n]);
+			return -1;
+		}
+		snprintf(spec, sizeof(spec), "%s", argv[n] + 8);
+		for(item = strtok_r(spec, ",", &save); item; item = strtok_r(NULL, ",", &save)){
+			if((colon = strchr(item, ':')) == NULL){
+				printf("%s: expected name:value\n", item);
+				return -1;
+			}
+			*colon = '\0';
+			for(k = 0; rlimit_names[k].name && strcmp(rlimit_names[k].name, item); k++)
+				;
+			if(rlimit_names[k].name == NULL){
+				printf("%s: unknown resource limit\n", item);
+				return -1;
+			}
+			if(opts->nrlimits == MAXRLIMITS){
+				printf("%s: too many limits\n", argv[n]);
+				return -1;
+			}
+			//@rlimit= values are plain counts or bytes, not ulimit's kbytes
+			if(parse_rlim(colon + 1, 1, &opts->rl[opts->nrlimits].rlim_cur) < 0){
+				printf("%s: bad limit value\n", colon + 1);
+				return -1;
+			}
+			opts->rl[opts->nrlimits].rlim_max = opts->rl[opts->nrlimits].rlim_cur;
+			opts->rl_res[opts->nrlimits++] = rlimit_names[k].resource;
+		}
+	}
+
+	//shift the command down over the option words
+	for(i = 0; n && argv[i + n - 1]; i++){
+		argv[i] = argv[i + n];
+	}
+	return 0;
+}
+
+/* 
+* dedup_digest - Key an @dedup command line by what it would do
+*
+* Hashes every word of every stage, the working directory and the
+* environment. A > or >> file on the last stage's stdout is left out of
+* the key (and out of argv): the output is captured and delivered to
+* each requester's own file instead, so sink says where this one's goes.
+*/
+uint64_t dedup_digest(char ***stages, int nstages, struct dedup_sink *sink){
+	uint64_t h = 14695981039346656037ULL;
+	struct redir rd;
+	char cwd[PATH_MAX], **argv, **ep;
+	int i, j, k, n;
+
+	sink->path = NULL;
+	for(k = 0; k < nstages; k++){
+		argv = stages[k];
+		for(i = j = 0; argv[i]; i += n){
+			n = parse_redir(argv, i, &rd);
+			if(k == nstages - 1 && n > 0 && rd.fd == STDOUT_FILENO && rd.flags != -1){
+				sink->path = rd.path;
+				sink->flags = rd.flags;
+				continue;
+			}
+			n = (n > 0) ? n : 1;
+			h = fnv1a_more(h, argv[i]);
+			if(n == 2){
+				h = fnv1a_more(h, argv[i+1]);
+			}
+			argv[j++] = argv[i];
+			if(n == 2){
+				argv[j++] = argv[i+1];
+			}
+		}
+		argv[j] = NULL;
+		h = fnv1a_more(h, "|");
+	}
+	if(getcwd(cwd, sizeof(cwd)) != NULL){
+		h = fnv1a_more(h, cwd);
+	}
+	for(ep = environ; *ep; ep++){
+		h = fnv1a_more(h, *ep);
+	}
+	return h;
+}
+
+/* fnv1a_more - Continue an FNV-1a hash h over s and its terminating NUL */
+uint64_t fnv1a_more(uint64_t h, const char *s){
+	do{
+		h ^= (unsigned char)*s;
+		h *= 1099511628211ULL;
+	}while(*s++);
+	return h;
+}
+
+/* 
+* dedup_lookup - Find the running @dedup command with this digest
+*
+* dedup_idx is an open-addressed table of indexes into dedup_ents,
+* probed linearly from the digest's home slot.
+*/
+struct dedup_ent *dedup_lookup(uint64_t digest){
+	int h;
+
+	for(h = digest & (DEDUPSLOTS - 1); dedup_idx[h] >= 0; h = (h + 1) & (DEDUPSLOTS - 1)){
+		if(dedup_ents[dedup_idx[h]].digest == digest){
+			return &dedup_ents[dedup_idx[h]];
+		}
+	}
+	return NULL;
+}
+
+/* 
+* dedup_add - Set up the entry for a new @dedup leader, with a memfd to
+*    capture its output in; dedup_start indexes it once it has a pid
+*/
+struct dedup_ent *dedup_add(uint64_t digest, struct dedup_sink *sink){
+	struct dedup_ent *dd;
+	int e;
+
+	for(e = 0; e < MAXJOBS && dedup_ents[e].state != DEDUP_FREE; e++)
+		;
+	if(e == MAXJOBS){
+		return NULL;
+	}
+	dd = &dedup_ents[e];
+	if((dd->memfd = fd_high(memfd_create("tsh-dedup", MFD_CLOEXEC))) < 0){
+		return NULL;
+	}
+	dd->digest = digest;
+	dd->nsinks = 0;
+	dedup_sink_add(dd, sink);
+	dd->state = DEDUP_STARTING;
+	return dd;
+}
+
+/* 
+* dedup_start - Index a leader's entry under its job's pid (SIGCHLD blocked)
+*/
+void dedup_start(struct dedup_ent *dd, pid_t pid){
+	int h;
+
+	dd->pid = pid;
+	dd->state = DEDUP_RUNNING;
+	for(h = dd->digest & (DEDUPSLOTS - 1); dedup_idx[h] >= 0; h = (h + 1) & (DEDUPSLOTS - 1))
+		;
+	dedup_idx[h] = dd - dedup_ents;
+}
+
+/* 
+* dedup_attach - Make a request wait on the running leader dd rather than
+*    launch; returns the leader's job, or NULL if it can't take another
+*
+* A foreground request brings the leader to the foreground, as fg would.
+*/
+struct job_t *dedup_attach(struct dedup_ent *dd, struct dedup_sink *sink, int bg){
+	struct job_t *job;
+
+	if((job = getjobpid(ctx->jobs, dd->pid)) == NULL || dd->nsinks == MAXSINKS){
+		return NULL;
+	}
+	dedup_sink_add(dd, sink);
+	if(!bg){
+		if(job->state == ST){
+			kill(-job->pid, SIGCONT);
+		}
+		job->state = FG;
+		shm_publish(job);
+	}
+	return job;
+}
+
+/* dedup_sink_add - Note one more place dd's output is to be delivered */
+void dedup_sink_add(struct dedup_ent *dd, struct dedup_sink *sink){
+	dd->sinks[dd->nsinks].path = sink->path ? strdup(sink->path) : NULL;
+	dd->sinks[dd->nsinks].flags = sink->flags;
+	dd->nsinks++;
+}
+
+/* 
+* dedup_done - Drop a finished leader from the index (reaping path, so
+*    signal context); its output goes out at the next dedup_deliver
+*
+* Deletes by shifting later entries of the probe run back, so lookups
+* never need tombstones.
+*/
+void dedup_done(pid_t pid, int status){
+	struct dedup_ent *dd;
+	int e, i, j, k;
+
+	for(e = 0; e < MAXJOBS; e++){
+		if(dedup_ents[e].state == DEDUP_RUNNING && dedup_ents[e].pid == pid){
+			break;
+		}
+	}
+	if(e == MAXJOBS){
+		return;
+	}
+	dd = &dedup_ents[e];
+	dd->status = status;
+	dd->state = DEDUP_DONE;
+
+	for(i = dd->digest & (DEDUPSLOTS - 1); dedup_idx[i] != e; i = (i + 1) & (DEDUPSLOTS - 1))
+		;
+	dedup_idx[i] = -1;
+	for(j = (i + 1) & (DEDUPSLOTS - 1); dedup_idx[j] >= 0; j = (j + 1) & (DEDUPSLOTS - 1)){
+		k = dedup_ents[dedup_idx[j]].digest & (DEDUPSLOTS - 1);
+		//move j into the hole unless its home slot lies cyclically in (i, j]
+		if((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)){
+			dedup_idx[i] = dedup_idx[j];
+			dedup_idx[j] = -1;
+			i = j;
+		}
+	}
+}
+
+/* 
+* dedup_deliver - Copy each finished leader's captured output to every
+*    requester's stdout (the shell's, or its own > file) and free it
+*/
+void dedup_deliver(void){
+	struct dedup_ent *dd;
+	char buf[INBUFSIZE];
+	ssize_t n;
+	int e, k, fd;
+
+	for(e = 0; e < MAXJOBS; e++){
+		dd = &dedup_ents[e];
+		if(dd->state != DEDUP_DONE){
+			continue;
+		}
+		fflush(stdout);
+		for(k = 0; k < dd->nsinks; k++){
+			fd = dd->sinks[k].path ? open(dd->sinks[k].path, dd->sinks[k].flags|O_CLOEXEC, 0666) : STDOUT_FILENO;
+			if(fd < 0){
+				printf("%s: %s\n", dd->sinks[k].path, strerror(errno));
+			}
+			else{
+				lseek(dd->memfd, 0, SEEK_SET);
+				while((n = read(dd->memfd, buf, sizeof(buf))) > 0 && write(fd, buf, n) == n)
+					;
+				if(fd != STDOUT_FILENO){
+					close(fd);
+				}
+			}
+			free(dd->sinks[k].path);
+		}
+		close(dd->memfd);
+		dd->nsinks = 0;
+		//last, so the handler never sees a half-freed entry as its own
+		dd->state = DEDUP_FREE;
+	}
+}
+
+/* 
+* apply_rlimits - Set a launching child's @rlimit= limits (child only)
+*/
+void apply_rlimits(struct launch_opts *opts){
+	int i;
+
+	for(i = 0; i < opts->nrlimits; i++){
+		if(setrlimit(opts->rl_res[i], &opts->rl[i]) < 0){
+			perror("setrlimit");
+			exit(1);
+		}
+	}
+}
+
+/* 
+* parse_rlim - Parse "unlimited" or a number with an optional K/M/G
+*    suffix, scaled by unit. Returns -1 if str isn't a limit.
+*/
+int parse_rlim(const char *str, rlim_t unit, rlim_t *val){
+	char *end;
+	unsigned long long n;
+
+	if(!strcmp(str, "unlimited")){
+		*val = RLIM_INFINITY;
+		return 0;
+	}
+	if(!isdigit(*str)){
+		return -1;
+	}
+	errno = 0;
+	n = strtoull(str, &end, 10);
+	if(errno){
+		return -1;
+	}
+	switch(*end){
+		case 'G': case 'g': n <<= 10;	/* fall through */
+		case 'M': case 'm': n <<= 10;	/* fall through */
+		case 'K': case 'k': n <<= 10; end++;
+		default: break;
+	}
+	if(*end != '\0'){
+		return -1;
+	}
+	*val = n * unit;
+	return 0;
+}
+
+/* 
+* do_ulimit - Execute the builtin ulimit command
+*
+* ulimit [-H|-S] [-a|-c|-n|-t|-u|-v] [value]
+* Without a value the limit is printed (soft unless -H); with one both
+* the soft and hard limits are set, or just the one named by -H/-S.
+* With no resource option, -n (open files) is used.
+*/
+void do_ulimit(char **argv){
+	int i, k, hard = 0, soft = 0, all = 0;
+	struct rlimit_name *rn = NULL;
+	struct rlimit rl;
+	rlim_t val, cur;
+
+	for(i = 1; argv[i] && argv[i][0] == '-' && argv[i][1]; i++){
+		char *f;
+		for(f = argv[i] + 1; *f; f++){
+			if(*f == 'H'){hard = 1; continue;}
+			if(*f == 'S'){soft = 1; continue;}
+			if(*f == 'a'){all = 1; continue;}
+			for(k = 0; rlimit_names[k].name && rlimit_names[k].flag != *f; k++)
+				;
+			if(rlimit_names[k].name == NULL){
+				printf("ulimit: -%c: invalid option\n", *f);
+				return;
+			}
+			rn = &rlimit_names[k];
+		}
+	}
+
+	//no value: print one limit, or all of them for -a
+	if(argv[i] == NULL){
+		for(k = 0; rlimit_names[k].name; k++){
+			if(all ? 0 : (rn ? rn != &rlimit_names[k] : rlimit_names[k].flag != 'n')){
+				continue;
+			}
+			getrlimit(rlimit_names[k].resource, &rl);
+			cur = hard ? rl.rlim_max : rl.rlim_cur;
+			if(all){
+				printf("%-26s(-%c) ", rlimit_names[k].desc, rlimit_names[k].flag);
+			}
+			if(cur == RLIM_INFINITY){
+				printf("unlimited\n");
+			}
+			else{
+				printf("%llu\n", (unsigned long long)(cur / rlimit_names[k].unit));
+			}
+		}
+		return;
+	}
+
+	if(rn == NULL){
+		rn = &rlimit_names[1];	/* nofile */
+	}
+	if(parse_rlim(argv[i], rn->unit, &val) < 0){
+		printf("ulimit: %s: invalid number\n", argv[i]);
+		return;
+	}
+	getrlimit(rn->resource, &rl);
+	if(hard || !soft){
+		rl.rlim_max = val;
+	}
+	if(soft || !hard){
+		rl.rlim_cur = val;
+	}
+	if(setrlimit(rn->resource, &rl) < 0){
+		printf("ulimit: %s\n", strerror(errno));
+	}
+}
+
+/* 
+* do_set - Execute the builtin set command
+*
+* set -o NAME / set +o NAME turn an option on or off; set -o alone
+* shows them. pipefail gives a pipeline the status of its rightmost
+* stage that failed, so false | cat fails; without it only the last
+* stage counts. pipethreads (on by default) runs adjacent stream
+* builtins (cat, wc, printf) as threads of one child.
+*/
+void do_set(char **argv){
+	int on;
+
+	if(argv[1] && !strcmp(argv[1], "-o") && argv[2] == NULL){
+		printf("pipefail\t%s\n", ctx->pipefail ? "on" : "off");
+		printf("pipethreads\t%s\n", ctx->nothreads ? "off" : "on");
+		return;
+	}
+	if(argv[1] == NULL || argv[2] == NULL || argv[3] != NULL ||
+	   (strcmp(argv[1], "-o") && strcmp(argv[1], "+o"))){
+		printf("usage: set [-o|+o] pipefail|pipethreads\n");
+		return;
+	}
+	on = (argv[1][0] == '-');
+	if(!strcmp(argv[2], "pipefail")){
+		ctx->pipefail = on;
+	}
+	else if(!strcmp(argv[2], "pipethreads")){
+		ctx->nothreads = !on;
+	}
+	else{
+		printf("set: %s: invalid option name\n", argv[2]);
+	}
+}
+
+/* 
+* do_pipestatus - Execute the builtin pipestatus command
+*
+* Prints the exit status of each stage of the last foreground job, left
+* to right, like bash's ${PIPESTATUS[@]}: a stage killed by a signal
+* shows as 128 + its number. pipestatus N prints stage N's (from 1) alone.
+*/
+void do_pipestatus(char **argv){
+	int i, n;
+
+	if(argv[1]){
+		n = atoi(argv[1]);
+		if(n < 1 || n > ctx->npipestatus){
+			printf("pipestatus: %s: no such stage\n", argv[1]);
+			builtin_status = 1;
+			return;
+		}
+		printf("%d\n", status_code(ctx->pipestatus[n - 1]));
+		return;
+	}
+	for(i = 0; i < ctx->npipestatus; i++){
+		printf(i ? " %d" : "%d", status_code(ctx->pipestatus[i]));
+	}
+	printf("\n");
+}
+
+/* 
+* do_trap - Execute the builtin trap command
+*
+* trap                     list the traps
+* trap 'cmd' SIG...        run cmd at the next safe point after SIG
+* trap - SIG...            remove the traps
+* SIG is a name from trap_names (EXIT, ERR, CHLD, USR1, ...) or a number.
+* INT, TSTP, CHLD and QUIT keep the shell's own handlers; a trap on them
+* runs in addition to the usual forwarding to the foreground job. A CHLD
+* trap runs once per batch of background jobs that exited or stopped,
+* not once per child.
+*/
+void do_trap(char **argv){
+	int i, k, sig;
+	char *cmd;
+	struct sigaction action;
+
+	if(argv[1] == NULL){
+		for(k = 0; trap_names[k].name; k++){
+			if(ctx->traps[trap_names[k].sig]){
+				printf("trap -- '%s' %s\n", ctx->traps[trap_names[k].sig], trap_names[k].name);
+			}
+		}
+		return;
+	}
+	if(argv[2] == NULL){
+		printf("trap: usage: trap [-|'command'] SIG...\n");
+		return;
+	}
+	cmd = strcmp(argv[1], "-") ? argv[1] : NULL;
+
+	for(i = 2; argv[i]; i++){
+		for(k = 0; trap_names[k].name && strcmp(trap_names[k].name, argv[i]); k++)
+			;
+		if(trap_names[k].name){
+			sig = trap_names[k].sig;
+		}
+		else if(isdigit(*argv[i]) && (sig = atoi(argv[i])) > 0 && sig < NSIG && sig != SIGKILL && sig != SIGSTOP){
+			;
+		}
+		else{
+			printf("trap: %s: invalid signal specification\n", argv[i]);
+			continue;
+		}
+
+		free(ctx->traps[sig]);
+		ctx->traps[sig] = cmd ? strdup(cmd) : NULL;
+
+		//these already have handlers that check for a trap themselves
+		if(sig == TRAP_EXIT || sig == TRAP_ERR || sig == SIGINT || sig == SIGTSTP ||
+		   sig == SIGCHLD || sig == SIGQUIT){
+			continue;
+		}
+		//no SA_RESTART, so a trapped signal also wakes the prompt's read
+		action.sa_handler = cmd ? (*cmd ? trap_handler : SIG_IGN) : SIG_DFL;
+		sigemptyset(&action.sa_mask);
+		action.sa_flags = 0;
+		sigaction(sig, &action, NULL);
+	}
+}
+
+/* 
+* run_traps - Run the commands of traps whose signals have arrived
+*
+* Called from tsh_events(); trap commands don't nest.
+*/
+void run_traps(struct tsh_ctx *c){
+	static int running = 0;
+	char line[MAXLINE];
+	int sig;
+
+	if(!c->ntrap_pending || running){
+		return;
+	}
+	running = 1;
+	c->ntrap_pending = 0;
+	for(sig = 1; sig <= NSIG; sig++){
+		if(!c->trap_pending[sig]){
+			continue;
+		}
+		c->trap_pending[sig] = 0;
+		if(c->traps[sig] && *c->traps[sig]){
+			snprintf(line, sizeof(line), "%s\n", c->traps[sig]);
+			eval(line, NULL);
+		}
+	}
+	running = 0;
+}
+
+/* 
+* shell_exit - Run the EXIT trap, if any, and exit
+*/
+void shell_exit(int status){
+	char line[MAXLINE];
+	char *cmd = ctx->traps[TRAP_EXIT];
+
+	if(cmd){
+		//clear it first so an exit inside the trap doesn't loop
+		ctx->traps[TRAP_EXIT] = NULL;
+		snprintf(line, sizeof(line), "%s\n", cmd);
+		eval(line, NULL);
+		fflush(stdout);
+	}
+	//shm_cleanup (an atexit hook) removes the published job table
+	exit(status);
+}
+
+/* 
+* do_reexec - Execute the builtin reexec command: reexec [path]
+*
+* Replaces the shell with path (default: the binary we were started
+* from, as it is on disk now) without losing any jobs. Jobs stay
+* children of the same pid across execve, so the new image only needs
+* the job table, which is written to a memfd whose number is passed in
+* $TSH_REEXEC_FD; restore_state reads it back. Traps, the prompt and any
+* input read but not yet run go along too.
+*/
+void do_reexec(char **argv){
+	char path[MAXLINE], num[16];
+	char *deleted;
+	sigset_t mask, prev;
+	ssize_t n;
+	int fd;
+
+	if(argv[1]){
+		snprintf(path, sizeof(path), "%s", argv[1]);
+	}
+	else{
+		//after an upgrade the link reads "/usr/bin/tsh (deleted)"; we want the new file at that path
+		if((n = readlink("/proc/self/exe", path, sizeof(path) - 1)) < 0){
+			printf("reexec: %s\n", strerror(errno));
+			return;
+		}
+		path[n] = '\0';
+		if((deleted = strstr(path, " (deleted)")) != NULL && deleted[10] == '\0'){
+			*deleted = '\0';
+		}
+	}
+
+	//report what's already queued, then hold SIGCHLD: a child that exits from
+	//here on stays a zombie with SIGCHLD pending, and the mask survives execve
+	tsh_events(ctx);
+	fflush(stdout);
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &prev);
+
+	if((fd = memfd_create("tsh-state", 0)) < 0 || save_state(fd) < 0){
+		printf("reexec: %s\n", strerror(errno));
+		if(fd >= 0){
+			close(fd);
+		}
+		sigprocmask(SIG_SETMASK, &prev, NULL);
+		return;
+	}
+	lseek(fd, 0, SEEK_SET);
+	snprintf(num, sizeof(num), "%d", fd);
+	setenv(REEXEC_ENV, num, 1);
+
+	execve(path, shell_argv, environ);
+
+	printf("reexec: %s: %s\n", path, strerror(errno));
+	unsetenv(REEXEC_ENV);
+	env_changed();
+	close(fd);
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/* 
+* save_state - Write the job table, traps, prompt and unread input to fd
+*
+* One record per line, so an older or newer tsh can still read it:
+*     tsh-state 1
+*     nextjid N
+*     prompt TEXT
+*     set pipefail
+*     set nopipethreads
+*     trap NAME COMMAND
+*     job JID PID STATE CMDLINE
+*     adopt JID PID STATE CMDLINE   (an attached job)
+*     start SEC NSEC MONOSEC MONONSEC   (its launch time, wall clock and monotonic)
+*     input LEN, then LEN raw bytes
+*/
+int save_state(int fd){
+	FILE *fp;
+	int i, k, sig;
+
+	if((fp = fdopen(dup(fd), "w")) == NULL){
+		return -1;
+	}
+	fprintf(fp, "tsh-state 1\n");
+	fprintf(fp, "nextjid %d\n", ctx->nextjid);
+	fprintf(fp, "prompt %s\n", prompt);
+	if(ctx->pipefail){
+		fprintf(fp, "set pipefail\n");
+	}
+	if(ctx->nothreads){
+		fprintf(fp, "set nopipethreads\n");
+	}
+	for(sig = 0; sig <= NSIG; sig++){
+		if(ctx->traps[sig] == NULL){
+			continue;
+		}
+		for(k = 0; trap_names[k].name && trap_names[k].sig != sig; k++)
+			;
+		if(trap_names[k].name){
+			fprintf(fp, "trap %s %s\n", trap_names[k].name, ctx->traps[sig]);
+		}
+		else{
+			fprintf(fp, "trap %d %s\n", sig, ctx->traps[sig]);
+		}
+	}
+	//cmdline keeps its own trailing newline; attached jobs need a new pidfd on the other side
+	for(i = 0; i < MAXJOBS; i++){
+		if(ctx->jobs[i].pid != 0){
+			fprintf(fp, "%s %d %d %d %s", ctx->jobs[i].pidfd >= 0 ? "adopt" : "job",
+				ctx->jobs[i].jid, ctx->jobs[i].pid, ctx->jobs[i].state, ctx->jobs[i].cmdline);
+			//CLOCK_MONOTONIC doesn't restart with the new image, so durations carry on
+			fprintf(fp, "start %lld %ld %lld %ld\n", (long long)ctx->jobs[i].start.tv_sec, ctx->jobs[i].start.tv_nsec,
+				(long long)ctx->jobs[i].start_mono.tv_sec, ctx->jobs[i].start_mono.tv_nsec);
+			//a pipeline's stages follow its job line; a reaped stage is pid 0
+			for(k = 0; ctx->jobs[i].nstages > 1 && k < ctx->jobs[i].nstages; k++){
+				fprintf(fp, "stage %d %d %d\n", k, ctx->jobs[i].pids[k], ctx->jobs[i].stage_status[k]);
+			}
+		}
+	}
+	if(input_loop && input_loop->inlen){
+		fprintf(fp, "input %d\n", input_loop->inlen);
+		fwrite(input_loop->inbuf, 1, input_loop->inlen, fp);
+	}
+	return fclose(fp) == EOF ? -1 : 0;
+}
+
+/* 
+* restore_state - Pick up the state save_state left in $TSH_REEXEC_FD
+*
+* Runs in the new image before its first prompt. SIGCHLD is still
+* blocked from the old one; unblocking it at the end reaps whatever
+* exited during the switch.
+*/
+void restore_state(struct evloop *ev){
+	FILE *fp;
+	char line[2 * MAXLINE];
+	char *targv[4];
+	char *name, *rest;
+	int fd, jid, pid, state, len, k;
+	int nextjid = 0;
+	struct job_t *job = NULL;
+	long long sec, monosec;
+	long nsec, mononsec;
+	sigset_t mask;
+
+	fd = atoi(getenv(REEXEC_ENV));
+	unsetenv(REEXEC_ENV);
+	env_changed();
+	if((fp = fdopen(fd, "r")) == NULL){
+		return;
+	}
+	if(fgets(line, sizeof(line), fp) == NULL || strcmp(line, "tsh-state 1\n")){
+		printf("reexec: unrecognised state, jobs not restored\n");
+		fclose(fp);
+		return;
+	}
+	while(fgets(line, sizeof(line), fp) != NULL){
+		if(sscanf(line, "job %d %d %d %n", &jid, &pid, &state, &len) == 3 ||
+		   sscanf(line, "adopt %d %d %d %n", &jid, &pid, &state, &len) == 3){
+			job = NULL;
+			if(addjob(ctx->jobs, pid, state, line + len)){
+				job = getjobpid(ctx->jobs, pid);
+				job->jid = jid;
+				if(line[0] == 'a'){
+					job->pidfd = fd_high(syscall(SYS_pidfd_open, pid, 0));
+				}
+			}
+		}
+		else if(sscanf(line, "start %lld %ld %lld %ld", &sec, &nsec, &monosec, &mononsec) == 4 && job){
+			job->start.tv_sec = sec;
+			job->start.tv_nsec = nsec;
+			job->start_mono.tv_sec = monosec;
+			job->start_mono.tv_nsec = mononsec;
+		}
+		else if(sscanf(line, "stage %d %d %d", &k, &pid, &state) == 3 && job && k >= 0 && k < MAXSTAGES){
+			job->pids[k] = pid;
+			job->stage_status[k] = state;
+			if(k >= job->nstages){
+				job->nstages = k + 1;
+			}
+			//the stages come in order, so the last one seen is the last stage
+			job->status = state;
+		}
+		else if(sscanf(line, "nextjid %d", &jid) == 1){
+			nextjid = jid;
+		}
+		else if(!strcmp(line, "set pipefail\n")){
+			ctx->pipefail = 1;
+		}
+		else if(!strcmp(line, "set nopipethreads\n")){
+			ctx->nothreads = 1;
+		}
+		else if(!strncmp(line, "prompt ", 7)){
+			line[strlen(line) - 1] = '\0';
+			len = strlen(line + 7);
+			len = (len < MAXLINE) ? len : MAXLINE - 1;
+			memcpy(prompt, line + 7, len);
+			prompt[len] = '\0';
+		}
+		else if(!strncmp(line, "trap ", 5)){
+			line[strlen(line) - 1] = '\0';
+			name = line + 5;
+			if((rest = strchr(name, ' ')) == NULL){
+				continue;
+			}
+			*rest++ = '\0';
+			targv[0] = "trap";
+			targv[1] = rest;
+			targv[2] = name;
+			targv[3] = NULL;
+			do_trap(targv);
+		}
+		else if(sscanf(line, "input %d", &len) == 1 && ev && len <= INBUFSIZE){
+			ev->inlen = fread(ev->inbuf, 1, len, fp);
+		}
+	}
+	fclose(fp);
+
+	//count live processes now all of them are in (a threaded run's stages share one)
+	for(jid = 0; jid < MAXJOBS; jid++){
+		ctx->jobs[jid].nlive = 0;
+		for(k = 0; k < ctx->jobs[jid].nstages; k++){
+			ctx->jobs[jid].nlive += (ctx->jobs[jid].pids[k] != 0 &&
+				(k == 0 || ctx->jobs[jid].pids[k] != ctx->jobs[jid].pids[k - 1]));
+		}
+		shm_publish(&ctx->jobs[jid]);
+	}
+
+	//addjob counted nextjid up as it went; put it back where the old image had it
+	if(nextjid > 0){
+		ctx->nextjid = nextjid;
+	}
+	//restored jobs may be reaped before anything is launched here, so the log has to be open already
+	timing_open();
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_UNBLOCK, &mask, NULL);
+}
+
+/* 
+* do_detach - Execute the builtin detach command: detach PID|%jobid
+*
+* Hands the job to the per-user registry of detached jobs and drops it
+* from the job list. A stopped job is continued first, since nobody
+* would be left to continue it. Its process group is its own, so the
+* terminal going away doesn't hang it up; a later attach (in this or
+* any other tsh of the same user) takes it back.
+*/
+void do_detach(char **argv){
+	struct job_t *job;
+	unsigned long long start;
+	int fd;
+
+	if((job = getjobarg(argv)) == NULL){
+		return;
+	}
+	if(proc_state(job->pid, &start) == 0){
+		printf("(%d): No such process\n", job->pid);
+		return;
+	}
+	if((fd = registry_open(O_WRONLY|O_CREAT|O_APPEND)) < 0){
+		printf("detach: %s\n", strerror(errno));
+		return;
+	}
+	//start time pins the entry to this process, not a later one reusing the pid
+	flock(fd, LOCK_EX);
+	dprintf(fd, "%d %llu %s", job->pid, start, job->cmdline);
+	close(fd);
+
+	if(job->state == ST){
+		kill(-job->pid, SIGCONT);
+	}
+	printf("[%d] (%d) detached\n", job->jid, job->pid);
+	if(job->pidfd >= 0){
+		close(job->pidfd);
+	}
+	job->pidfd = -1;
+	deletejob(ctx->jobs, job->pid);
+}
+
+/* 
+* do_attach - Execute the builtin attach command: attach [PID]
+*
+* Adopts detached jobs (all of them, or the one with PID) from the
+* registry into the job list. They aren't our children, so instead of
+* SIGCHLD each carries a pidfd: poll_adopted notices when it exits and
+* waitfg polls it, along with /proc, to see it stop. fg, bg, ctrl-c and
+* ctrl-z work as usual since they are just signals to the group. Exit
+* statuses of adopted jobs can't be collected.
+*/
+void do_attach(char **argv){
+	char line[MAXLINE + 64];
+	char *keep = NULL;
+	size_t keeplen = 0;
+	unsigned long long start, now;
+	int pid, len, pidfd, fd, state;
+	struct job_t *job;
+	FILE *fp, *out;
+
+	if((fd = registry_open(O_RDWR)) < 0){
+		if(errno == ENOENT){
+			printf("attach: no detached jobs\n");
+		}
+		else{
+			printf("attach: %s\n", strerror(errno));
+		}
+		return;
+	}
+	flock(fd, LOCK_EX);
+	fp = fdopen(fd, "r+");
+	out = open_memstream(&keep, &keeplen);
+
+	while(fgets(line, sizeof(line), fp) != NULL){
+		if(sscanf(line, "%d %llu %n", &pid, &start, &len) != 2){
+			continue;
+		}
+		//gone, or its pid now belongs to something else: drop the entry
+		if((state = proc_state(pid, &now)) == 0 || now != start){
+			continue;
+		}
+		if((argv[1] && atoi(argv[1]) != pid) || getjobpid(ctx->jobs, pid)){
+			fputs(line, out);
+			continue;
+		}
+		if((pidfd = fd_high(syscall(SYS_pidfd_open, pid, 0))) < 0 ||
+		   !addjob(ctx->jobs, pid, state == 'T' ? ST : BG, line + len)){
+			if(pidfd >= 0){
+				close(pidfd);
+			}
+			fputs(line, out);
+			continue;
+		}
+		job = getjobpid(ctx->jobs, pid);
+		job->pidfd = pidfd;
+		printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
+	}
+	fclose(out);
+
+	//what's left stays detached
+	if(ftruncate(fd, 0) == 0){
+		pwrite(fd, keep, keeplen, 0);
+	}
+	free(keep);
+	fclose(fp);
+}
+
+/* 
+* poll_adopted - Drop adopted jobs whose pidfd says they have exited
+*
+* Called from tsh_events() before it hands out events, and from eval;
+* one poll() covers all adopted jobs. Each exit is queued as a JOB_DONE
+* event like the handler's, so it reaches on_job too.
+*/
+void poll_adopted(struct tsh_ctx *c){
+	struct pollfd pfds[MAXJOBS];
+	struct job_t *owner[MAXJOBS];
+	sigset_t mask, prev;
+	int i, n = 0;
+
+	for(i = 0; i < MAXJOBS; i++){
+		if(c->jobs[i].pid != 0 && c->jobs[i].pidfd >= 0){
+			pfds[n].fd = c->jobs[i].pidfd;
+			pfds[n].events = POLLIN;
+			owner[n++] = &c->jobs[i];
+		}
+	}
+	if(n == 0 || poll(pfds, n, 0) <= 0){
+		return;
+	}
+	//the queue is the handler's too
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &prev);
+	for(i = 0; i < n; i++){
+		if(pfds[i].revents){
+			queue_event(owner[i], JOB_DONE, 0);
+			close(owner[i]->pidfd);
+			owner[i]->pidfd = -1;
+			deletejob(c->jobs, owner[i]->pid);
+			c->ndone++;
+		}
+	}
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/* 
+* waitfg_adopted - waitfg for an adopted job: block on its pidfd for exit
+*    and look in /proc for a stop, since no SIGCHLD will come
+*
+* A stop has no wakeup of its own, so /proc is checked every 10ms for a
+* short while after a signal interrupts the wait (ctrl-z is forwarded
+* from here), and otherwise once a second for a stop sent from elsewhere.
+*/
+void waitfg_adopted(struct job_t *job){
+	struct pollfd pfd;
+	unsigned long long start;
+	sigset_t mask, prev;
+	int n, checks = 0;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	pfd.fd = job->pidfd;
+	pfd.events = POLLIN;
+	while(job->state == FG){
+		n = poll(&pfd, 1, checks > 0 ? 10 : 1000);
+		sigprocmask(SIG_BLOCK, &mask, &prev);
+		if(n > 0){
+			queue_event(job, JOB_DONE, 0);
+			close(job->pidfd);
+			job->pidfd = -1;
+			deletejob(ctx->jobs, job->pid);
+			ctx->ndone++;
+			sigprocmask(SIG_SETMASK, &prev, NULL);
+			return;
+		}
+		//which signal stopped it isn't in /proc; ctrl-z's is the likely one
+		if(proc_state(job->pid, &start) == 'T'){
+			queue_event(job, JOB_STOPPED, W_STOPCODE(SIGTSTP));
+			job->state = ST;
+			shm_publish(job);
+		}
+		sigprocmask(SIG_SETMASK, &prev, NULL);
+		//~100ms of checks after each signal, for the stop to land
+		checks = (n < 0 && errno == EINTR) ? 10 : checks - 1;
+	}
+}
+
+/* 
+* proc_state - Return the /proc state letter of pid (R, S, T, ...) and
+*    its start time, or 0 if there is no such process
+*/
+int proc_state(pid_t pid, unsigned long long *start){
+	char path[64], buf[512];
+	char *p;
+	int fd, n, field;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	if((fd = open(path, O_RDONLY|O_CLOEXEC)) < 0){
+		return 0;
+	}
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	//the command name can hold spaces and parens, so fields count from the last ')'
+	if(n <= 0 || (buf[n] = '\0', p = strrchr(buf, ')')) == NULL || p[1] == '\0'){
+		return 0;
+	}
+	p += 2;
+	n = *p;
+	//field 3 is the state, field 22 the start time
+	for(field = 3; field < 22 && (p = strchr(p, ' ')) != NULL; field++){
+		p++;
+	}
+	*start = p ? strtoull(p, NULL, 10) : 0;
+	return n == 'Z' || n == 'X' ? 0 : n;
+}
+
+/* 
+* registry_path - Where detached jobs are listed: $XDG_RUNTIME_DIR, or /tmp
+*
+* The /tmp name is predictable, so only open it through registry_open.
+*/
+int registry_path(char *buf, size_t len){
+	char *dir = getenv("XDG_RUNTIME_DIR");
+
+	if(dir){
+		snprintf(buf, len, "%s/%s", dir, DETACH_FILE);
+	}
+	else{
+		snprintf(buf, len, "/tmp/%s-%d", DETACH_FILE, (int)getuid());
+	}
+	return 0;
+}
+
+/* 
+* registry_open - Open the registry of detached jobs with open() flags
+*
+* Never follows a symlink, creates it only with O_EXCL, and refuses a
+* file that isn't a plain file of this user's that only it can read
+* and write (errno EPERM): anyone could have made the /tmp one first.
+* Returns the fd, or -1 with errno set (ENOENT if there is none yet).
+*/
+int registry_open(int flags){
+	char path[MAXLINE];
+	struct stat st;
+	int fd = -1;
+
+	registry_path(path, sizeof(path));
+	//O_NONBLOCK so a FIFO planted there fails instead of hanging us
+	flags |= O_NOFOLLOW|O_NONBLOCK|O_CLOEXEC;
+	if(flags & O_CREAT){
+		if((fd = open(path, flags|O_EXCL, S_IRUSR|S_IWUSR)) < 0 && errno != EEXIST){
+			return -1;
+		}
+	}
+	if(fd < 0 && (fd = open(path, flags & ~O_CREAT)) < 0){
+		return -1;
+	}
+	if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)){
+		close(fd);
+		errno = EPERM;
+		return -1;
+	}
+	return fd;
+}
+
+/* timing_open - Open the timing log ($TSH_TIMINGS) if that hasn't been tried yet */
+void timing_open(void){
+	char *path;
+
+	if(ctx->timingfd != -1){
+		return;
+	}
+	path = getenv(TIMING_ENV);
+	ctx->timingfd = path ? fd_high(open(path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, S_IRUSR|S_IWUSR)) : -2;
+	if(ctx->timingfd == -1){
+		printf("%s: %s\n", path, strerror(errno));
+		ctx->timingfd = -2;
+	}
+}
+
+/* 
+* log_timing - Append a finished job's timing record to the log
+*
+* Called from sigchld_handler, so only async-signal-safe calls: one
+* clock_gettime and one O_APPEND write of a fixed-size record.
+*/
+void log_timing(struct job_t *job, int status, struct rusage *ru){
+	struct timing_rec rec;
+	struct timespec now;
+	const char *p = job->cmdline;
+	unsigned i;
+
+	if(ctx->timingfd < 0){
+		return;
+	}
+	memset(&rec, 0, sizeof(rec));
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	//name is argv[0]: the first word that isn't an @launch option
+	for(;;){
+		while(*p == ' '){
+			p++;
+		}
+		if(*p != '@'){
+			break;
+		}
+		while(*p && *p != ' '){
+			p++;
+		}
+	}
+	for(i = 0; i < sizeof(rec.name) - 1 && p[i] && p[i] != ' ' && p[i] != '\n'; i++){
+		rec.name[i] = p[i];
+	}
+
+	rec.cmdhash = fnv1a(job->cmdline);
+	rec.start_ns = job->start.tv_sec * 1000000000LL + job->start.tv_nsec;
+	rec.dur_ns = (now.tv_sec - job->start_mono.tv_sec) * 1000000000LL +
+		(now.tv_nsec - job->start_mono.tv_nsec);
+	rec.utime_us = ru->ru_utime.tv_sec * 1000000LL + ru->ru_utime.tv_usec;
+	rec.stime_us = ru->ru_stime.tv_sec * 1000000LL + ru->ru_stime.tv_usec;
+	rec.maxrss_kb = ru->ru_maxrss;
+	rec.status = status;
+	if(write(ctx->timingfd, &rec, sizeof(rec)) < 0){
+		//nothing useful to do about it in a handler
+	}
+}
+
+/* fnv1a - 64-bit FNV-1a hash of a string */
+uint64_t fnv1a(const char *s){
+	uint64_t h = 14695981039346656037ULL;
+
+	while(*s){
+		h ^= (unsigned char)*s++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/* 
+* do_slowest - Execute the builtin slowest command
+*
+* slowest [--since AGE] [--cmd NAME] [-n COUNT]
+* Summarises the timing log per command name: runs, p50, p99 and max
+* duration, slowest p99 first. AGE is a number of seconds, or a number
+* followed by s, m, h or d. The log is mmap'd and scanned once,
+* collecting each command's durations into its own array.
+*/
+void do_slowest(char **argv){
+	char *path = getenv(TIMING_ENV);
+	char *since = NULL, *cmd = NULL, *end;
+	struct timing_rec *recs;
+	struct timing_group *tab = NULL, *t, *g;
+	struct stat st;
+	struct timespec now;
+	size_t nrecs, i, cap = 0, ngroups = 0, k;
+	long long cutoff = 0, age, *dur;
+	int fd, top = 10, shown;
+	uint64_t h;
+
+	for(i = 1; argv[i]; i++){
+		if(!strcmp(argv[i], "--since") && argv[i+1]){
+			since = argv[++i];
+		}
+		else if(!strcmp(argv[i], "--cmd") && argv[i+1]){
+			cmd = argv[++i];
+		}
+		else if(!strcmp(argv[i], "-n") && argv[i+1]){
+			top = atoi(argv[++i]);
+		}
+		else{
+			printf("usage: slowest [--since AGE] [--cmd NAME] [-n COUNT]\n");
+			return;
+		}
+	}
+	if(since){
+		age = strtoll(since, &end, 10);
+		switch(*end){
+			case 'd': age *= 24;	/* fall through */
+			case 'h': age *= 60;	/* fall through */
+			case 'm': age *= 60;	/* fall through */
+			case 's': case '\0': break;
+			default:
+				printf("slowest: %s: bad age\n", since);
+				return;
+		}
+		clock_gettime(CLOCK_REALTIME, &now);
+		cutoff = (now.tv_sec - age) * 1000000000LL;
+	}
+
+	if(path == NULL){
+		printf("slowest: set %s to a file to record command timings\n", TIMING_ENV);
+		return;
+	}
+	if((fd = open(path, O_RDONLY|O_CLOEXEC)) < 0 || fstat(fd, &st) < 0){
+		printf("slowest: %s: %s\n", path, strerror(errno));
+		if(fd >= 0){
+			close(fd);
+		}
+		return;
+	}
+	nrecs = st.st_size / sizeof(struct timing_rec);
+	if(nrecs == 0){
+		close(fd);
+		return;
+	}
+	recs = mmap(NULL, nrecs * sizeof(struct timing_rec), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(recs == MAP_FAILED){
+		printf("slowest: mmap: %s\n", strerror(errno));
+		return;
+	}
+	madvise(recs, nrecs * sizeof(struct timing_rec), MADV_SEQUENTIAL);
+
+	//one pass: hash each record's name into an open-addressed table of groups
+	for(i = 0; i < nrecs; i++){
+		if(recs[i].start_ns < cutoff || (cmd && strncmp(recs[i].name, cmd, sizeof(recs[i].name)))){
+			continue;
+		}
+		if(2 * (ngroups + 1) > cap){
+			if((t = regroup(tab, &cap)) == NULL){
+				break;
+			}
+			tab = t;
+		}
+		h = fnv1a_n(recs[i].name, sizeof(recs[i].name));
+		for(k = h & (cap - 1); tab[k].name; k = (k + 1) & (cap - 1)){
+			if(tab[k].hash == h && !strncmp(tab[k].name, recs[i].name, sizeof(recs[i].name))){
+				break;
+			}
+		}
+		g = &tab[k];
+		if(g->name == NULL){
+			g->name = recs[i].name;
+			g->hash = h;
+			ngroups++;
+		}
+		if(g->n == g->cap){
+			if((dur = realloc(g->dur, (g->cap ? 2 * g->cap : 16) * sizeof(g->dur[0]))) == NULL){
+				break;
+			}
+			g->dur = dur;
+			g->cap = g->cap ? 2 * g->cap : 16;
+		}
+		g->dur[g->n++] = recs[i].dur_ns;
+	}
+	//out of memory part way: drop what was built (the table isn't packed yet)
+	if(i < nrecs){
+		printf("slowest: %s\n", strerror(ENOMEM));
+		for(i = 0; i < cap; i++){
+			free(tab[i].dur);
+		}
+		free(tab);
+		munmap(recs, nrecs * sizeof(struct timing_rec));
+		return;
+	}
+
+	//pack the groups, work out percentiles, slowest p99 first
+	for(i = k = 0; i < cap; i++){
+		if(tab[i].name){
+			g = &tab[i];
+			qsort(g->dur, g->n, sizeof(g->dur[0]), cmp_ll);
+			g->p50 = pct_rank(g->dur, g->n, 50);
+			g->p99 = pct_rank(g->dur, g->n, 99);
+			tab[k++] = *g;
+		}
+	}
+	qsort(tab, ngroups, sizeof(tab[0]), cmp_group_p99);
+
+	printf("%-24s %8s %12s %12s %12s\n", "command", "runs", "p50 (ms)", "p99 (ms)", "max (ms)");
+	for(i = 0, shown = 0; i < ngroups && shown < top; i++, shown++){
+		g = &tab[i];
+		printf("%-24.*s %8zu %12.3f %12.3f %12.3f\n", (int)sizeof(recs[0].name), g->name, g->n,
+			g->p50 / 1e6, g->p99 / 1e6, g->dur[g->n - 1] / 1e6);
+	}
+	for(i = 0; i < ngroups; i++){
+		free(tab[i].dur);
+	}
+	free(tab);
+	munmap(recs, nrecs * sizeof(struct timing_rec));
+}
+
+/* regroup - Double the group table (to 64 at first), rehashing what's in it; NULL, with tab untouched, if out of memory */
+struct timing_group *regroup(struct timing_group *tab, size_t *cap){
+	size_t newcap = *cap ? 2 * *cap : 64;
+	struct timing_group *t = calloc(newcap, sizeof(*t));
+	size_t i, k;
+
+	if(t == NULL){
+		return NULL;
+	}
+	for(i = 0; i < *cap; i++){
+		if(tab[i].name){
+			for(k = tab[i].hash & (newcap - 1); t[k].name; k = (k + 1) & (newcap - 1))
+				;
+			t[k] = tab[i];
+		}
+	}
+	free(tab);
+	*cap = newcap;
+	return t;
+}
+
+/* fnv1a_n - fnv1a over at most n bytes */
+uint64_t fnv1a_n(const char *s, size_t n){
+	uint64_t h = 14695981039346656037ULL;
+
+	while(n-- && *s){
+		h ^= (unsigned char)*s++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/* cmp_ll - qsort comparison for long longs, ascending */
+int cmp_ll(const void *a, const void *b){
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* pct_rank - Nearest-rank pct'th percentile of the n (> 0) sorted values in v: v[ceil(pct * n / 100) - 1] */
+long long pct_rank(const long long *v, int n, int pct){
+	return v[((long long)n * pct + 99) / 100 - 1];
+}
+
+/* cmp_group_p99 - qsort comparison for timing groups, highest p99 first */
+int cmp_group_p99(const void *a, const void *b){
+	long long x = ((const struct timing_group *)a)->p99;
+	long long y = ((const struct timing_group *)b)->p99;
+
+	return (x < y) - (x > y);
+}
+
+/* 
+* do_checksum - Execute the builtin checksum command
+*
+* checksum [-a sha256|crc32c|xxh64] [-j threads] file...
+*
+* Hashes the files on a pool of threads (one per online CPU by default)
+* and prints "HASH  file" lines in argument order, the format sha256sum
+* prints and checks. Each file is read and hashed HASHBLOCK bytes at a
+* time, so a pipe or /dev/zero costs no more memory than a small file,
+* and ctrl-c stops the lot. Scripts that ran one sha256sum process per
+* file pay for one builtin instead.
+*/
+void do_checksum(char **argv){
+	struct checksum_run run;
+	pthread_t tids[MAXHASHTHREADS];
+	sigset_t all, prev;
+	char *end;
+	int i, nthreads = 0, started;
+
+	memset(&run, 0, sizeof(run));
+	interrupted = 0;
+	run.algo = &hash_algos[0];
+	for(i = 1; argv[i] && argv[i][0] == '-' && argv[i][1]; i++){
+		if(!strcmp(argv[i], "-a") && argv[i+1]){
+			for(run.algo = hash_algos; run.algo->name && strcmp(run.algo->name, argv[i+1]); run.algo++)
+				;
+			if(run.algo->name == NULL){
+				printf("checksum: unknown algorithm %s (sha256, crc32c or xxh64)\n", argv[i+1]);
+				return;
+			}
+			i++;
+		}
+		else if(!strcmp(argv[i], "-j") && argv[i+1]){
+			nthreads = strtol(argv[++i], &end, 10);
+			if(*end || nthreads < 1){
+				printf("checksum: bad thread count %s\n", argv[i]);
+				return;
+			}
+		}
+		else{
+			printf("usage: checksum [-a sha256|crc32c|xxh64] [-j threads] file...\n");
+			return;
+		}
+	}
+	run.files = &argv[i];
+	for(run.nfiles = 0; run.files[run.nfiles]; run.nfiles++)
+		;
+	if(run.nfiles == 0){
+		printf("checksum command requires a file argument\n");
+		return;
+	}
+
+	if(nthreads == 0){
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if(nthreads > MAXHASHTHREADS){
+		nthreads = MAXHASHTHREADS;
+	}
+	if(nthreads > run.nfiles){
+		nthreads = run.nfiles;
+	}
+	run.out = calloc(run.nfiles, sizeof(*run.out));
+	run.err = calloc(run.nfiles, sizeof(*run.err));
+	if(run.out == NULL || run.err == NULL){
+		printf("checksum: %s\n", strerror(errno));
+		free(run.out);
+		free(run.err);
+		return;
+	}
+	hash_setup();
+
+	//workers keep every signal blocked, so the handlers only ever run on the shell's own thread
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &prev);
+	for(started = 0; started < nthreads; started++){
+		if(pthread_create(&tids[started], NULL, checksum_worker, &run) != 0){
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &prev, NULL);
+	//no thread at all: hash them here
+	if(started == 0){
+		checksum_worker(&run);
+	}
+	for(i = 0; i < started; i++){
+		pthread_join(tids[i], NULL);
+	}
+
+	for(i = 0; i < run.nfiles; i++){
+		//ctrl-c: the files after the first one it cut short weren't hashed either
+		if(run.err[i] == EINTR){
+			printf("checksum: interrupted\n");
+			break;
+		}
+		if(run.err[i]){
+			printf("checksum: %s: %s\n", run.files[i], strerror(run.err[i]));
+		}
+		else{
+			printf("%s  %s\n", run.out[i], run.files[i]);
+		}
+	}
+	free(run.out);
+	free(run.err);
+}
+
+/* 
+* checksum_worker - Hash files from run until there are none left
+*
+* Files are handed out one at a time through an atomic counter, so a
+* thread that drew small files just takes more of them. Each thread
+* has its own HASHBLOCK read buffer.
+*/
+void *checksum_worker(void *arg){
+	struct checksum_run *run = arg;
+	unsigned char digest[32], *buf;
+	int i, k;
+
+	if((buf = malloc(HASHBLOCK)) == NULL){
+		return NULL;
+	}
+	while((i = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED)) < run->nfiles){
+		//ctrl-c: mark the rest undone rather than start on them
+		if(interrupted){
+			run->err[i] = EINTR;
+			continue;
+		}
+		if(hash_file(run->algo, run->files[i], buf, digest) < 0){
+			run->err[i] = errno;
+			continue;
+		}
+		for(k = 0; k < run->algo->len; k++){
+			sprintf(&run->out[i][2*k], "%02x", digest[k]);
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+/* 
+* hash_file - Hash the contents of path into out with algo
+*
+* Reads it into buf (HASHBLOCK bytes) a block at a time. read() rather
+* than mmap: a file truncated under a mapping would SIGBUS the shell.
+* Returns 0, or -1 with errno set if the file couldn't be read or
+* ctrl-c (EINTR) stopped it.
+*/
+int hash_file(const struct hash_algo *algo, const char *path, unsigned char *buf, unsigned char *out){
+	struct hash_state hs;
+	struct stat st;
+	ssize_t n;
+	int fd, olderrno;
+
+	if((fd = open(path, O_RDONLY|O_CLOEXEC)) < 0){
+		return -1;
+	}
+	if(fstat(fd, &st) < 0){
+		goto fail;
+	}
+	if(S_ISDIR(st.st_mode)){
+		errno = EISDIR;
+		goto fail;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	algo->init(&hs);
+	while((n = read(fd, buf, HASHBLOCK)) != 0){
+		if(interrupted){
+			errno = EINTR;
+			goto fail;
+		}
+		if(n < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			goto fail;
+		}
+		algo->update(&hs, buf, n);
+	}
+	algo->final(&hs, out);
+	close(fd);
+	return 0;
+
+fail:
+	olderrno = errno;
+	close(fd);
+	errno = olderrno;
+	return -1;
+}
+
+/* 
+* hash_setup - Pick each hash's fastest implementation for this CPU
+*
+* Called before the workers start, so they only ever read the results.
+*/
+void hash_setup(void){
+	uint32_t crc;
+	int i, k;
+#if defined(__x86_64__)
+	unsigned int a, b, c, d;
+
+	if(__get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & bit_SHA)){
+		sha256_blocks = sha256_blocks_ni;
+	}
+	if(__builtin_cpu_supports("sse4.2")){
+		crc32c_update = crc32c_update_hw;
+	}
+#endif
+	if(crc32c_table[1] == 0){
+		for(i = 0; i < 256; i++){
+			crc = i;
+			for(k = 0; k < 8; k++){
+				crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+			}
+			crc32c_table[i] = crc;
+		}
+	}
+}
+
+/* sha256_init - Start a FIPS 180-4 SHA-256 */
+void sha256_init(struct hash_state *hs){
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(hs->h.sha, iv, sizeof(iv));
+	hs->total = 0;
+	hs->buflen = 0;
+}
+
+/* sha256_update - Hash p[0..n) on; whole blocks go straight from p */
+void sha256_update(struct hash_state *hs, const unsigned char *p, size_t n){
+	size_t take;
+
+	hs->total += n;
+	if(hs->buflen > 0){
+		take = (64 - hs->buflen < n) ? 64 - hs->buflen : n;
+		memcpy(hs->buf + hs->buflen, p, take);
+		hs->buflen += take;
+		p += take;
+		n -= take;
+		if(hs->buflen < 64){
+			return;
+		}
+		sha256_blocks(hs->h.sha, hs->buf, 1);
+		hs->buflen = 0;
+	}
+	sha256_blocks(hs->h.sha, p, n / 64);
+	memcpy(hs->buf, p + n / 64 * 64, n % 64);
+	hs->buflen = n % 64;
+}
+
+/* sha256_final - Pad, finish and write the 32-byte digest */
+void sha256_final(struct hash_state *hs, unsigned char *out){
+	unsigned char tail[128];
+	size_t rest = hs->buflen, tlen;
+	uint64_t bits = hs->total * 8;
+	int i;
+
+	//pad: 0x80, zeros, then the bit length big endian; one or two more blocks
+	memcpy(tail, hs->buf, rest);
+	tlen = (rest < 56) ? 64 : 128;
+	memset(tail + rest, 0, tlen - rest);
+	tail[rest] = 0x80;
+	for(i = 0; i < 8; i++){
+		tail[tlen - 1 - i] = bits >> (8 * i);
+	}
+	sha256_blocks(hs->h.sha, tail, tlen / 64);
+	for(i = 0; i < 8; i++){
+		out[4*i] = hs->h.sha[i] >> 24;
+		out[4*i+1] = hs->h.sha[i] >> 16;
+		out[4*i+2] = hs->h.sha[i] >> 8;
+		out[4*i+3] = hs->h.sha[i];
+	}
+}
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/* sha256_blocks_sw - SHA-256 compression of nblocks 64-byte blocks, portable C */
+void sha256_blocks_sw(uint32_t st[8], const unsigned char *p, size_t nblocks){
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for(; nblocks > 0; nblocks--, p += 64){
+		for(i = 0; i < 16; i++){
+			w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16 | (uint32_t)p[4*i+2] << 8 | p[4*i+3];
+		}
+		for(i = 16; i < 64; i++){
+			w[i] = w[i-16] + (ROR32(w[i-15], 7) ^ ROR32(w[i-15], 18) ^ (w[i-15] >> 3))
+				+ w[i-7] + (ROR32(w[i-2], 17) ^ ROR32(w[i-2], 19) ^ (w[i-2] >> 10));
+		}
+		a = st[0]; b = st[1]; c = st[2]; d = st[3];
+		e = st[4]; f = st[5]; g = st[6]; h = st[7];
+		for(i = 0; i < 64; i++){
+			t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+			t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+		st[0] += a; st[1] += b; st[2] += c; st[3] += d;
+		st[4] += e; st[5] += f; st[6] += g; st[7] += h;
+	}
+}
+
+#if defined(__x86_64__)
+/* 
+* sha256_blocks_ni - SHA-256 compression with the SHA extensions
+*
+* The state is kept as ABEF/CDGH halves, the layout sha256rnds2 wants;
+* each pass of the loop does four rounds and, while they are needed,
+* extends the message schedule four words ahead.
+*/
+__attribute__((target("sha,sse4.1")))
+void sha256_blocks_ni(uint32_t st[8], const unsigned char *p, size_t nblocks){
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, msg, tmp, m[4], abef, cdgh;
+	int g;
+
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&st[0]), 0xB1);	/* CDAB */
+	state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&st[4]), 0x1B);	/* EFGH */
+	state0 = _mm_alignr_epi8(tmp, state1, 8);		/* ABEF */
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);	/* CDGH */
+
+	for(; nblocks > 0; nblocks--, p += 64){
+		abef = state0;
+		cdgh = state1;
+		for(g = 0; g < 16; g++){
+			if(g < 4){
+				m[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16*g)), bswap);
+			}
+			msg = _mm_add_epi32(m[g&3], _mm_loadu_si128((const __m128i *)&sha256_k[4*g]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			if(g >= 3 && g < 15){
+				tmp = _mm_alignr_epi8(m[g&3], m[(g-1)&3], 4);
+				m[(g+1)&3] = _mm_sha256msg2_epu32(_mm_add_epi32(m[(g+1)&3], tmp), m[g&3]);
+			}
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+			if(g >= 1 && g < 13){
+				m[(g-1)&3] = _mm_sha256msg1_epu32(m[(g-1)&3], m[g&3]);
+			}
+		}
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);			/* FEBA */
+	state1 = _mm_shuffle_epi32(state1, 0xB1);		/* DCHG */
+	_mm_storeu_si128((__m128i *)&st[0], _mm_blend_epi16(tmp, state1, 0xF0));	/* DCBA */
+	_mm_storeu_si128((__m128i *)&st[4], _mm_alignr_epi8(state1, tmp, 8));		/* HGFE */
+}
+
+/* crc32c_update_hw - CRC-32C with the SSE4.2 crc32 instruction, 8 bytes a step */
+__attribute__((target("sse4.2")))
+uint32_t crc32c_update_hw(uint32_t crc, const unsigned char *p, size_t n){
+	uint64_t c = crc, w;
+
+	for(; n >= 8; n -= 8, p += 8){
+		memcpy(&w, p, 8);
+		c = _mm_crc32_u64(c, w);
+	}
+	crc = c;
+	for(; n > 0; n--){
+		crc = _mm_crc32_u8(crc, *p++);
+	}
+	return crc;
+}
+#endif
+
+/* crc32c_update_sw - CRC-32C (Castagnoli, reflected), a table byte at a time */
+uint32_t crc32c_update_sw(uint32_t crc, const unsigned char *p, size_t n){
+	while(n--){
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+/* crc32c_init - Start a CRC-32C */
+void crc32c_init(struct hash_state *hs){
+	hs->h.crc = ~0U;
+}
+
+/* crc32c_more - CRC-32C p[0..n) on */
+void crc32c_more(struct hash_state *hs, const unsigned char *p, size_t n){
+	hs->h.crc = crc32c_update(hs->h.crc, p, n);
+}
+
+/* crc32c_final - The CRC, big endian into out (as crc32c tools print it) */
+void crc32c_final(struct hash_state *hs, unsigned char *out){
+	uint32_t crc = ~hs->h.crc;
+
+	out[0] = crc >> 24;
+	out[1] = crc >> 16;
+	out[2] = crc >> 8;
+	out[3] = crc;
+}
+
+#define XXP1 11400714785074694791ULL
+#define XXP2 14029467366897019727ULL
+#define XXP3 1609587929392839161ULL
+#define XXP4 9650029242287828579ULL
+#define XXP5 2870177450012600261ULL
+#define ROL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+/* xxh64_round - One XXH64 accumulator step */
+uint64_t xxh64_round(uint64_t acc, uint64_t in){
+	acc += in * XXP2;
+	acc = ROL64(acc, 31);
+	return acc * XXP1;
+}
+
+/* xxh64_init - Start an XXH64 (seed 0) */
+void xxh64_init(struct hash_state *hs){
+	hs->h.xx[0] = XXP1 + XXP2;
+	hs->h.xx[1] = XXP2;
+	hs->h.xx[2] = 0;
+	hs->h.xx[3] = -XXP1;
+	hs->total = 0;
+	hs->buflen = 0;
+}
+
+/* xxh64_update - Hash p[0..n) on, four independent lanes per 32-byte stripe */
+void xxh64_update(struct hash_state *hs, const unsigned char *p, size_t n){
+	const unsigned char *end = p + n;
+	uint64_t w;
+	size_t take;
+	int i;
+
+	hs->total += n;
+	if(hs->buflen > 0){
+		take = (32 - hs->buflen < n) ? 32 - hs->buflen : n;
+		memcpy(hs->buf + hs->buflen, p, take);
+		hs->buflen += take;
+		p += take;
+		if(hs->buflen < 32){
+			return;
+		}
+		for(i = 0; i < 4; i++){
+			memcpy(&w, hs->buf + 8*i, 8);
+			hs->h.xx[i] = xxh64_round(hs->h.xx[i], w);
+		}
+		hs->buflen = 0;
+	}
+	for(; end - p >= 32; p += 32){
+		for(i = 0; i < 4; i++){
+			memcpy(&w, p + 8*i, 8);
+			hs->h.xx[i] = xxh64_round(hs->h.xx[i], w);
+		}
+	}
+	memcpy(hs->buf, p, end - p);
+	hs->buflen = end - p;
+}
+
+/* xxh64_final - Merge the lanes, mix in the tail, big endian into out (xxhsum's canonical form) */
+void xxh64_final(struct hash_state *hs, unsigned char *out){
+	const unsigned char *p = hs->buf, *end = hs->buf + hs->buflen;
+	uint64_t *v = hs->h.xx, h, w;
+	uint32_t w32;
+	int i;
+
+	if(hs->total >= 32){
+		h = ROL64(v[0], 1) + ROL64(v[1], 7) + ROL64(v[2], 12) + ROL64(v[3], 18);
+		for(i = 0; i < 4; i++){
+			h = (h ^ xxh64_round(0, v[i])) * XXP1 + XXP4;
+		}
+	}
+	else{
+		h = XXP5;
+	}
+	h += hs->total;
+	for(; end - p >= 8; p += 8){
+		memcpy(&w, p, 8);
+		h ^= xxh64_round(0, w);
+		h = ROL64(h, 27) * XXP1 + XXP4;
+	}
+	if(end - p >= 4){
+		memcpy(&w32, p, 4);
+		h ^= (uint64_t)w32 * XXP1;
+		h = ROL64(h, 23) * XXP2 + XXP3;
+		p += 4;
+	}
+	for(; p < end; p++){
+		h ^= *p * XXP5;
+		h = ROL64(h, 11) * XXP1;
+	}
+	h ^= h >> 33;
+	h *= XXP2;
+	h ^= h >> 29;
+	h *= XXP3;
+	h ^= h >> 32;
+	for(i = 0; i < 8; i++){
+		out[i] = h >> (56 - 8*i);
+	}
+}
+
+/* 
+* do_walk - Execute the builtin walk command
+*
+* walk [-0] [-j threads] [-maxdepth N] [-name GLOB] [-type f|d|l]
+*      [-size [+-]N[cwbkMG]] [-mtime [+-]DAYS] [DIR...]
+*
+* Prints every path under each DIR (default .) that passes the filters,
+* like find, but reads directories on a pool of threads. -size counts
+* as find does: in 512-byte blocks unless a unit is given, with the file
+* size rounded up to whole units (so -size -1M only matches empty files). -0 separates
+* paths with NUL for xargs -0. Output order isn't defined; each thread
+* buffers its paths and writes whole entries in WALKBUF-sized writes,
+* so paths from different threads never interleave.
+*/
+void do_walk(char **argv){
+	struct walk_run run;
+	pthread_t tids[MAXHASHTHREADS];
+	sigset_t all, prev;
+	struct stat st;
+	struct walk_dir *d;
+	char **roots, *end, *arg;
+	char buf[WALKBUF];
+	size_t len = 0;
+	int i, nroots = 0, nthreads = 0, started;
+
+	memset(&run, 0, sizeof(run));
+	run.sep = '\n';
+	run.maxdepth = -1;
+	if((roots = calloc(MAXARGS, sizeof(*roots))) == NULL){
+		return;
+	}
+	for(i = 1; argv[i]; i++){
+		arg = argv[i];
+		if(arg[0] != '-'){
+			roots[nroots++] = arg;
+			continue;
+		}
+		if(!strcmp(arg, "-0")){
+			run.sep = '\0';
+			continue;
+		}
+		if(argv[i+1] == NULL){
+			goto usage;
+		}
+		arg = argv[++i];
+		if(!strcmp(argv[i-1], "-j")){
+			nthreads = strtol(arg, &end, 10);
+			if(*end || nthreads < 1){
+				goto usage;
+			}
+		}
+		else if(!strcmp(argv[i-1], "-maxdepth")){
+			run.maxdepth = strtol(arg, &end, 10);
+			if(*end || run.maxdepth < 0){
+				goto usage;
+			}
+		}
+		else if(!strcmp(argv[i-1], "-name")){
+			run.name = arg;
+		}
+		else if(!strcmp(argv[i-1], "-type")){
+			run.type = !strcmp(arg, "f") ? DT_REG : !strcmp(arg, "d") ? DT_DIR : !strcmp(arg, "l") ? DT_LNK : -1;
+			if(run.type < 0){
+				goto usage;
+			}
+		}
+		else if(!strcmp(argv[i-1], "-size")){
+			run.sizecmp = (*arg == '+') - (*arg == '-');
+			arg += (*arg == '+' || *arg == '-');
+			run.size = strtoll(arg, &end, 10);
+			run.sizeunit = (*end == 'c') ? 1 : (*end == 'w') ? 2 : (*end == 'k') ? 1024 :
+			               (*end == 'M') ? 1 << 20 : (*end == 'G') ? 1 << 30 : 512;
+			if(!isdigit(*arg) || run.size < 0 || (*end && (end[1] || !strchr("cwbkMG", *end)))){
+				goto usage;
+			}
+			run.hassize = 1;
+		}
+		else if(!strcmp(argv[i-1], "-mtime")){
+			run.mtimecmp = (*arg == '+') - (*arg == '-');
+			run.mtime = strtol(arg + (*arg == '+' || *arg == '-'), &end, 10);
+			if(*end || run.mtime < 0){
+				goto usage;
+			}
+			run.hasmtime = 1;
+		}
+		else{
+			goto usage;
+		}
+	}
+	if(nroots == 0){
+		roots[nroots++] = ".";
+	}
+	run.needstat = run.hassize || run.hasmtime;
+	run.now = time(NULL);
+	interrupted = 0;
+	pthread_mutex_init(&run.lock, NULL);
+	pthread_mutex_init(&run.outlock, NULL);
+	pthread_cond_init(&run.more, NULL);
+	//anything printf'd earlier goes out before our direct writes to fd 1
+	fflush(stdout);
+
+	//the roots themselves are tested like any entry, then queued for the workers
+	for(i = 0; i < nroots; i++){
+		if(lstat(roots[i], &st) < 0){
+			fprintf(stderr, "walk: %s: %s\n", roots[i], strerror(errno));
+			continue;
+		}
+		if(walk_match(&run, roots[i], IFTODT(st.st_mode), &st)){
+			walk_emit(&run, buf, &len, roots[i]);
+		}
+		if(S_ISDIR(st.st_mode) && run.maxdepth != 0 && (d = malloc(sizeof(*d))) != NULL){
+			d->path = strdup(roots[i]);
+			d->depth = 0;
+			walk_push(&run, d);
+		}
+	}
+	walk_flush(&run, buf, &len);
+	free(roots);
+
+	if(nthreads == 0){
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if(nthreads > MAXHASHTHREADS){
+		nthreads = MAXHASHTHREADS;
+	}
+	//workers keep every signal blocked, so the handlers only ever run on the shell's own thread
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &prev);
+	for(started = 0; started < nthreads; started++){
+		if(pthread_create(&tids[started], NULL, walk_worker, &run) != 0){
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &prev, NULL);
+	if(started == 0){
+		walk_worker(&run);
+	}
+	for(i = 0; i < started; i++){
+		pthread_join(tids[i], NULL);
+	}
+	pthread_mutex_destroy(&run.lock);
+	pthread_mutex_destroy(&run.outlock);
+	pthread_cond_destroy(&run.more);
+	if(interrupted){
+		printf("walk: interrupted\n");
+	}
+	return;
+
+usage:
+	free(roots);
+	printf("usage: walk [-0] [-j threads] [-maxdepth N] [-name GLOB] [-type f|d|l] [-size [+-]N[cwbkMG]] [-mtime [+-]DAYS] [DIR...]\n");
+}
+
+/* 
+* walk_worker - Read directories off run's stack until the walk is done
+*
+* The walk is done when the stack is empty and no thread is still
+* reading a directory (which could push more). After a ctrl-c the
+* directories still queued are dropped unread.
+*/
+void *walk_worker(void *arg){
+	struct walk_run *run = arg;
+	struct walk_dir *d;
+	char buf[WALKBUF];
+	size_t len = 0;
+
+	while(1){
+		pthread_mutex_lock(&run->lock);
+		while(run->stack == NULL && run->busy > 0){
+			pthread_cond_wait(&run->more, &run->lock);
+		}
+		if((d = run->stack) == NULL){
+			pthread_mutex_unlock(&run->lock);
+			break;
+		}
+		run->stack = d->next;
+		pthread_mutex_unlock(&run->lock);
+
+		//ctrl-c (the shell's handler only sets interrupted): empty the stack without reading
+		if(!interrupted){
+			walk_read(run, d, buf, &len);
+		}
+		free(d->path);
+		free(d);
+
+		pthread_mutex_lock(&run->lock);
+		if(--run->busy == 0){
+			pthread_cond_broadcast(&run->more);
+		}
+		pthread_mutex_unlock(&run->lock);
+	}
+	walk_flush(run, buf, &len);
+	return NULL;
+}
+
+/* 
+* walk_read - List one directory with getdents64, emitting matches and
+*    queueing subdirectories
+*
+* d_type says what each entry is without a stat; entries are only
+* fstatat'd (relative to the open directory) when a size or mtime test
+* needs it or the filesystem leaves d_type unknown.
+*/
+void walk_read(struct walk_run *run, struct walk_dir *d, char *buf, size_t *len){
+	char dents[WALKBUF];
+	char path[PATH_MAX];
+	struct linux_dirent64 *de;
+	struct walk_dir *sub;
+	struct stat st, *stp;
+	long n = 0, off;
+	int fd, type, plen;
+
+	if((fd = open(d->path, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0){
+		fprintf(stderr, "walk: %s: %s\n", d->path, strerror(errno));
+		return;
+	}
+	//"dir/" once, then each name is copied in after it
+	plen = snprintf(path, sizeof(path), "%s%s", d->path, d->path[strlen(d->path)-1] == '/' ? "" : "/");
+	//a huge directory stops part way on ctrl-c too
+	while(!interrupted && (n = syscall(SYS_getdents64, fd, dents, sizeof(dents))) > 0){
+		for(off = 0; off < n; off += de->d_reclen){
+			de = (struct linux_dirent64 *)(dents + off);
+			if(de->d_name[0] == '.' && (de->d_name[1] == '\0' || (de->d_name[1] == '.' && de->d_name[2] == '\0'))){
+				continue;
+			}
+			if(plen + strlen(de->d_name) >= sizeof(path)){
+				continue;
+			}
+			strcpy(path + plen, de->d_name);
+			type = de->d_type;
+			stp = NULL;
+			if(type == DT_UNKNOWN || run->needstat){
+				if(fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0){
+					continue;
+				}
+				type = IFTODT(st.st_mode);
+				stp = &st;
+			}
+			if(walk_match(run, path, type, stp)){
+				walk_emit(run, buf, len, path);
+			}
+			if(type == DT_DIR && (run->maxdepth < 0 || d->depth + 1 < run->maxdepth)){
+				if((sub = malloc(sizeof(*sub))) != NULL && (sub->path = strdup(path)) != NULL){
+					sub->depth = d->depth + 1;
+					walk_push(run, sub);
+				}
+				else{
+					free(sub);
+				}
+			}
+		}
+	}
+	if(n < 0){
+		fprintf(stderr, "walk: %s: %s\n", d->path, strerror(errno));
+	}
+	close(fd);
+}
+
+/* walk_match - Does path (of d_type type, stat st if needed) pass run's filters */
+int walk_match(struct walk_run *run, const char *path, int type, struct stat *st){
+	const char *base;
+	off_t size;
+	long age;
+
+	if(run->type && type != run->type){
+		return 0;
+	}
+	if(run->name){
+		base = strrchr(path, '/');
+		base = (base && base[1]) ? base + 1 : path;
+		if(fnmatch(run->name, base, 0) != 0){
+			return 0;
+		}
+	}
+	if(run->hassize && st){
+		//whole units, rounded up
+		size = (st->st_size + run->sizeunit - 1) / run->sizeunit;
+		if((run->sizecmp > 0 && size <= run->size) || (run->sizecmp < 0 && size >= run->size) ||
+		   (run->sizecmp == 0 && size != run->size)){
+			return 0;
+		}
+	}
+	if(run->hasmtime && st){
+		//whole days since the last change, as find -mtime counts them
+		age = (run->now - st->st_mtime) / 86400;
+		if((run->mtimecmp > 0 && age <= run->mtime) || (run->mtimecmp < 0 && age >= run->mtime) ||
+		   (run->mtimecmp == 0 && age != run->mtime)){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* walk_push - Queue a directory for the workers */
+void walk_push(struct walk_run *run, struct walk_dir *d){
+	pthread_mutex_lock(&run->lock);
+	d->next = run->stack;
+	run->stack = d;
+	run->busy++;
+	pthread_cond_signal(&run->more);
+	pthread_mutex_unlock(&run->lock);
+}
+
+/* walk_emit - Add path and its separator to a thread's output buffer */
+void walk_emit(struct walk_run *run, char *buf, size_t *len, const char *path){
+	size_t n = strlen(path);
+
+	if(*len + n + 1 > WALKBUF){
+		walk_flush(run, buf, len);
+	}
+	memcpy(buf + *len, path, n);
+	buf[*len + n] = run->sep;
+	*len += n + 1;
+}
+
+/* walk_flush - Write out a thread's buffered paths in one go */
+void walk_flush(struct walk_run *run, char *buf, size_t *len){
+	size_t done = 0;
+	ssize_t n;
+
+	pthread_mutex_lock(&run->outlock);
+	while(done < *len){
+		if((n = write(STDOUT_FILENO, buf + done, *len - done)) < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			break;
+		}
+		done += n;
+	}
+	pthread_mutex_unlock(&run->outlock);
+	*len = 0;
+}
+
+/* 
+* do_spawn - Execute the builtin spawn command
+*
+* spawn [-n count] [-j threads] cmd [args...]
+*
+* Starts count copies of cmd from a pool of spawner threads, each
+* calling posix_spawn, and waits for all of them. Spawn results come
+* back to this thread through spawn_run's ring; children are reaped
+* here with SIGCHLD blocked, and any job-list child that changes state
+* meanwhile goes through reap_child just as the handler would take it.
+* Between results this thread sleeps in ppoll on the spawners' eventfd
+* and a signalfd for SIGCHLD. ctrl-c stops the spawners and sends
+* SIGINT to the copies still running. Prints the launch rate and the
+* p50/p99 posix_spawn latency.
+*/
+void do_spawn(char **argv){
+	struct spawn_run *run;
+	struct spawn_slot *slot;
+	struct signalfd_siginfo si;
+	struct pollfd pfd[2];
+	pthread_t tids[MAXHASHTHREADS];
+	sigset_t all, cur, prev, chld, pollmask;
+	struct timespec t0, t1;
+	struct rusage ru;
+	long long *lat;
+	pid_t *pids, *gone;
+	uint64_t val;
+	char *end = "";
+	double secs;
+	pid_t pid;
+	int i, k, status, nthreads = 1, started, consumed = 0, live = 0;
+	int nlat = 0, failed = 0, nonzero = 0, reaped = 0, ngone = 0, killed = 0, strays = 0, n, nenv;
+
+	if((run = calloc(1, sizeof(*run))) == NULL){
+		return;
+	}
+	interrupted = 0;
+	run->count = 1;
+	for(i = 1; argv[i] && argv[i][0] == '-'; i += 2){
+		if(argv[i+1] == NULL || (strcmp(argv[i], "-n") && strcmp(argv[i], "-j"))){
+			break;
+		}
+		if(argv[i][1] == 'n'){
+			run->count = strtol(argv[i+1], &end, 10);
+		}
+		else{
+			nthreads = strtol(argv[i+1], &end, 10);
+		}
+		if(*end || run->count < 1 || nthreads < 1){
+			break;
+		}
+	}
+	if(argv[i] == NULL || argv[i][0] == '-' || *end){
+		printf("usage: spawn [-n count] [-j threads] [NAME=value...] cmd [args...]\n");
+		free(run);
+		return;
+	}
+	run->argv = &argv[i];
+	//NAME=value words: one environment for every copy, built once
+	run->envp = environ;
+	if((n = env_words(run->argv)) > 0){
+		nenv = env_index()->n;
+		if(run->argv[n] == NULL || (run->envp = malloc((nenv + n + 1) * sizeof(char *))) == NULL){
+			printf("usage: spawn [-n count] [-j threads] [NAME=value...] cmd [args...]\n");
+			free(run);
+			return;
+		}
+		make_envp(run->envp, environ, run->argv, n);
+		run->argv += n;
+	}
+	if(nthreads > MAXHASHTHREADS){
+		nthreads = MAXHASHTHREADS;
+	}
+	lat = malloc(run->count * sizeof(*lat));
+	//the pids started and reaped, so ctrl-c signals only the ones still running
+	pids = malloc(run->count * sizeof(*pids));
+	gone = malloc(run->count * sizeof(*gone));
+	//SIGCHLD arrives through the signalfd; SIGINT only while we sleep, so a ctrl-c is never missed
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigaddset(&chld, SIGINT);
+	sigprocmask(SIG_BLOCK, &chld, &prev);
+	pollmask = prev;
+	sigaddset(&pollmask, SIGCHLD);
+	sigdelset(&pollmask, SIGINT);
+	sigdelset(&chld, SIGINT);
+	started = 0;
+	run->evfd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	pfd[0].fd = run->evfd;
+	pfd[1].fd = signalfd(-1, &chld, SFD_CLOEXEC|SFD_NONBLOCK);
+	pfd[0].events = pfd[1].events = POLLIN;
+	if(lat == NULL || pids == NULL || gone == NULL || pfd[0].fd < 0 || pfd[1].fd < 0){
+		printf("spawn: %s\n", strerror(errno));
+		goto out;
+	}
+	//children start with nothing blocked, each in its own process group like any job
+	sigemptyset(&all);
+	posix_spawnattr_init(&run->attr);
+	posix_spawnattr_setsigmask(&run->attr, &all);
+	posix_spawnattr_setpgroup(&run->attr, 0);
+	posix_spawnattr_setflags(&run->attr, POSIX_SPAWN_SETSIGMASK|POSIX_SPAWN_SETPGROUP);
+	fflush(stdout);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	//spawners keep every signal blocked
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &cur);
+	run->active = nthreads;
+	for(started = 0; started < nthreads; started++){
+		if(pthread_create(&tids[started], NULL, spawn_worker, run) != 0){
+			break;
+		}
+	}
+	__atomic_sub_fetch(&run->active, nthreads - started, __ATOMIC_SEQ_CST);
+	pthread_sigmask(SIG_SETMASK, &cur, NULL);
+	//(the spawners need this thread to empty the ring, so it can't stand in for them)
+	if(started == 0){
+		printf("spawn: no spawner thread: %s\n", strerror(errno));
+		posix_spawnattr_destroy(&run->attr);
+		goto out;
+	}
+
+	while(consumed < run->count || live > 0){
+		//take every result the spawners have published, in ring order
+		slot = &run->ring[run->head % SPAWNRING];
+		for(k = 0; __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == run->head + 1; k++){
+			if(slot->err){
+				if(failed++ == 0){
+					printf("spawn: %s: %s\n", run->argv[0], strerror(slot->err));
+				}
+			}
+			else{
+				pids[nlat] = slot->pid;
+				lat[nlat++] = slot->lat_ns;
+				live++;
+			}
+			consumed++;
+			__atomic_store_n(&run->head, run->head + 1, __ATOMIC_SEQ_CST);
+			slot = &run->ring[run->head % SPAWNRING];
+		}
+		//spawners held up by a full ring can go on
+		if(k > 0 && __atomic_load_n(&run->fullwait, __ATOMIC_SEQ_CST)){
+			syscall(SYS_futex, &run->head, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+		}
+		//reap whatever has exited
+		while((pid = wait4(-1, &status, WUNTRACED|WNOHANG, &ru)) > 0){
+			if(getjobstage(ctx->jobs, pid, &i) != NULL){
+				reaped += reap_child(pid, status, &ru);
+			}
+			else if(!WIFSTOPPED(status)){
+				//ours, possibly reaped before its spawn result was read (live dips below 0 then)
+				gone[ngone++] = pid;
+				live--;
+				nonzero += !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+			}
+		}
+		if(interrupted && !run->stop){
+			__atomic_store_n(&run->stop, 1, __ATOMIC_SEQ_CST);
+			syscall(SYS_futex, &run->head, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+		}
+		//stopped spawners are done once they are all gone: what they published is all there is
+		if(run->stop && __atomic_load_n(&run->active, __ATOMIC_SEQ_CST) == 0 &&
+		   run->count != (int)__atomic_load_n(&run->tail, __ATOMIC_SEQ_CST)){
+			run->count = __atomic_load_n(&run->tail, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		if(run->stop && consumed == run->count && !killed){
+			//every copy started is known now: interrupt the ones still running
+			killed = 1;
+			live = spawn_unreaped(pids, nlat, gone, ngone, SIGINT, &strays);
+		}
+		//the count can be off by strays; only the lists say for sure that all are in
+		if(consumed == run->count && live <= 0){
+			live = spawn_unreaped(pids, nlat, gone, ngone, 0, &strays);
+		}
+		if(consumed == run->count && (live <= 0 || (pid < 0 && errno == ECHILD))){
+			break;
+		}
+
+		//sleep until a result, a child's exit or ctrl-c; waiting goes up before the
+		//last look at the ring, so a spawner that publishes after it sees it
+		__atomic_store_n(&run->waiting, 1, __ATOMIC_SEQ_CST);
+		slot = &run->ring[run->head % SPAWNRING];
+		if(__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != run->head + 1 &&
+		   !(run->stop && __atomic_load_n(&run->active, __ATOMIC_SEQ_CST) == 0)){
+			ppoll(pfd, 2, NULL, &pollmask);
+		}
+		__atomic_store_n(&run->waiting, 0, __ATOMIC_SEQ_CST);
+		while(read(pfd[0].fd, &val, sizeof(val)) > 0)
+			;
+		while(read(pfd[1].fd, &si, sizeof(si)) > 0)
+			;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for(i = 0; i < started; i++){
+		pthread_join(tids[i], NULL);
+	}
+	posix_spawnattr_destroy(&run->attr);
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("spawn: %d started in %.3fs (%.0f/s) with %d thread%s", nlat, secs, nlat / secs, nthreads, nthreads == 1 ? "" : "s");
+	if(nlat){
+		qsort(lat, nlat, sizeof(*lat), cmp_ll);
+		printf(", spawn latency p50 %lldus p99 %lldus", pct_rank(lat, nlat, 50) / 1000, pct_rank(lat, nlat, 99) / 1000);
+	}
+	//(a stray exited 127 and was counted)
+	printf("; %d failed to start, %d exited non-zero%s\n", failed, nonzero - strays, run->stop ? " (interrupted)" : "");
+
+out:
+	//job-list changes seen here count for the CHLD trap as if the handler had seen them
+	if(reaped){
+		mark_trap(SIGCHLD);
+		wake_main();
+	}
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+	if(pfd[0].fd >= 0){
+		close(pfd[0].fd);
+	}
+	if(pfd[1].fd >= 0){
+		close(pfd[1].fd);
+	}
+	if(run->envp != environ){
+		free(run->envp);
+	}
+	free(lat);
+	free(pids);
+	free(gone);
+	free(run);
+}
+
+/* 
+* spawn_unreaped - How many of the started pids haven't been reaped
+*
+* Both lists are sorted and walked together. A pid the kernel reused
+* within the run shows up more than once; it is still running if it was
+* started more often than it was reaped. The unreaped ones are zombies
+* at worst, so none of them can belong to anyone else yet, and sig (if
+* not 0) is sent to each. *strays gets the reaped pids that were never
+* started: a copy that failed to exec, taken by our wait4 before
+* posix_spawn could reap it itself.
+*/
+int spawn_unreaped(pid_t *pids, int npids, pid_t *gone, int ngone, int sig, int *strays){
+	int i, k = 0, n = 0;
+
+	qsort(pids, npids, sizeof(*pids), cmp_pid);
+	qsort(gone, ngone, sizeof(*gone), cmp_pid);
+	*strays = 0;
+	for(i = 0; i < npids; i++){
+		for( ; k < ngone && gone[k] < pids[i]; k++){
+			(*strays)++;
+		}
+		if(k < ngone && gone[k] == pids[i]){
+			k++;
+			continue;
+		}
+		n++;
+		if(sig){
+			kill(pids[i], sig);
+		}
+	}
+	*strays += ngone - k;
+	return n;
+}
+
+/* cmp_pid - qsort order for pids */
+int cmp_pid(const void *a, const void *b){
+	pid_t x = *(const pid_t *)a, y = *(const pid_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* 
+* spawn_worker - Start copies of run's command until count are started,
+*    publishing each result in run's ring
+*
+* The ring is a bounded multi-producer queue: a spawner claims a slot
+* with one atomic add on tail, waits (on the head futex) for the reader
+* to have freed it, fills it and releases it by storing seq, waking the
+* shell through evfd if it sleeps. The reader never takes a lock, and
+* spawners only contend on the add.
+*/
+void *spawn_worker(void *arg){
+	struct spawn_run *run = arg;
+	struct spawn_slot *slot;
+	struct timespec t0, t1;
+	unsigned pos, head;
+	pid_t pid;
+	int err;
+
+	while(!__atomic_load_n(&run->stop, __ATOMIC_RELAXED) &&
+	      __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED) < run->count){
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		err = posix_spawn(&pid, run->argv[0], NULL, &run->attr, run->argv, run->envp);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		pos = __atomic_fetch_add(&run->tail, 1, __ATOMIC_SEQ_CST);
+		while((head = __atomic_load_n(&run->head, __ATOMIC_SEQ_CST)) + SPAWNRING <= pos){
+			__atomic_add_fetch(&run->fullwait, 1, __ATOMIC_SEQ_CST);
+			if(__atomic_load_n(&run->head, __ATOMIC_SEQ_CST) == head){
+				syscall(SYS_futex, &run->head, FUTEX_WAIT_PRIVATE, head, NULL, NULL, 0);
+			}
+			__atomic_sub_fetch(&run->fullwait, 1, __ATOMIC_SEQ_CST);
+		}
+		slot = &run->ring[pos % SPAWNRING];
+		slot->pid = err ? 0 : pid;
+		slot->err = err;
+		slot->lat_ns = (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec);
+		__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+		spawn_wake(run);
+	}
+	//the shell may be waiting for the last spawner to go
+	__atomic_sub_fetch(&run->active, 1, __ATOMIC_SEQ_CST);
+	spawn_wake(run);
+	return NULL;
+}
+
+/* spawn_wake - Wake the shell if it sleeps waiting on run */
+void spawn_wake(struct spawn_run *run){
+	uint64_t one = 1;
+	ssize_t n;
+
+	if(__atomic_load_n(&run->waiting, __ATOMIC_SEQ_CST)){
+		n = write(run->evfd, &one, sizeof(one));
+		(void)n;
+	}
+}
+
+/* 
+* do_bench - Execute the builtin bench command
+*
+* bench [-n runs] [-w warmups] [-o] [--json FILE] cmd...
+*
+* Each cmd is one command line, quoted if it has spaces
+* (bench -n 20 '/bin/sleep 0.01' '/bin/sleep 0.02'). Every run is one
+* posix_spawn, as spawn starts them, timed from just before the spawn
+* to the wait4 that reaps it on CLOCK_MONOTONIC; user and sys come from
+* that wait4's rusage. Runs are one at a time and the warmups aren't
+* counted. The command's output goes to /dev/null unless -o.
+* Prints mean ± stddev, min, median, p95 and max wall time, mean CPU
+* time and the outliers, then how the commands compare; --json also
+* writes every run's time to FILE (- for stdout). ctrl-c stops it.
+*/
+void do_bench(char **argv){
+	struct bench_cmd *cmds, *b, *fast;
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_t fa;
+	sigset_t all, chld, prev;
+	struct redir rd;
+	char *json = NULL, *end = "";
+	FILE *fp;
+	int i, k, n, nenv, bad = 0, err = 0, ncmds = 0, runs = 10, warmups = 0, show = 0;
+	double ratio, rsd;
+
+	for(i = 1; argv[i] && argv[i][0] == '-'; i++){
+		if(!strcmp(argv[i], "-o")){
+			show = 1;
+			continue;
+		}
+		if(argv[i+1] == NULL){
+			break;
+		}
+		if(!strcmp(argv[i], "--json")){
+			json = argv[++i];
+		}
+		else if(!strcmp(argv[i], "-n")){
+			runs = strtol(argv[++i], &end, 10);
+		}
+		else if(!strcmp(argv[i], "-w")){
+			warmups = strtol(argv[++i], &end, 10);
+		}
+		else{
+			break;
+		}
+		if(*end || runs < 1 || warmups < 0){
+			break;
+		}
+	}
+	if(argv[i] == NULL || argv[i][0] == '-' || *end || runs < 1 || warmups < 0){
+		printf("usage: bench [-n runs] [-w warmups] [-o] [--json FILE] cmd...\n");
+		return;
+	}
+	if((cmds = calloc(MAXBENCH, sizeof(*cmds))) == NULL){
+		return;
+	}
+	for(; argv[i] && ncmds < MAXBENCH; i++){
+		b = &cmds[ncmds++];
+		b->line = argv[i];
+		b->envp = environ;
+		parseline(argv[i], b->buf, b->argv);
+		//NAME=value words, as for spawn: one environment for every run
+		if((n = env_words(b->argv)) > 0 && b->argv[n] == NULL){
+			b->argv[0] = NULL;
+		}
+		else if(n > 0){
+			nenv = env_index()->n;
+			if((b->envp = malloc((nenv + n + 1) * sizeof(char *))) != NULL){
+				make_envp(b->envp, environ, b->argv, n);
+				memmove(b->argv, b->argv + n, (MAXARGS - n) * sizeof(char *));
+			}
+		}
+		//runs are spawned directly, so a redirection or | would only reach the command as an argument
+		for(k = 0; b->argv[0] && b->argv[k] && strcmp(b->argv[k], "|") && parse_redir(b->argv, k, &rd) == 0; k++)
+			;
+		if(b->argv[0] && b->argv[k]){
+			printf("bench: %s: redirections and pipes are not supported\n", argv[i]);
+			bad = 1;
+		}
+		else if(b->argv[0] == NULL || b->envp == NULL || (b->wall = malloc(runs * sizeof(long long))) == NULL){
+			printf("bench: %s: nothing to run\n", argv[i]);
+			bad = 1;
+		}
+	}
+	if(argv[i]){
+		printf("bench: at most %d commands\n", MAXBENCH);
+		bad = 1;
+	}
+
+	//each run starts as spawn's do: nothing blocked, in its own process group
+	sigemptyset(&all);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &all);
+	posix_spawnattr_setpgroup(&attr, 0);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK|POSIX_SPAWN_SETPGROUP);
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_addopen(&fa, 0, "/dev/null", O_RDONLY, 0);
+	if(!show){
+		posix_spawn_file_actions_addopen(&fa, 1, "/dev/null", O_WRONLY, 0);
+		posix_spawn_file_actions_adddup2(&fa, 1, 2);
+	}
+
+	//the runs are reaped here, not by the handler
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, &prev);
+	fflush(stdout);
+	interrupted = 0;
+	//warmups first for every command, then the timed runs interleaved so drift hits all alike
+	b = NULL;
+	for(k = -warmups; !bad && !err && k < runs; k++){
+		for(i = 0; !err && i < ncmds; i++){
+			b = &cmds[i];
+			if((err = bench_run(b, &attr, &fa)) == 0 && k < 0){
+				b->nruns = 0;
+				b->user = b->sys = 0;
+				b->nonzero = 0;
+			}
+		}
+	}
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+	posix_spawn_file_actions_destroy(&fa);
+	posix_spawnattr_destroy(&attr);
+	if(err > 0){
+		printf("bench: %s: %s\n", b->argv[0], strerror(err));
+	}
+
+	fast = NULL;
+	for(i = 0; i < ncmds; i++){
+		b = &cmds[i];
+		if(b->nruns == 0){
+			continue;
+		}
+		bench_stats(b);
+		printf("%s (%d run%s%s)\n", b->line, b->nruns, b->nruns == 1 ? "" : "s", err < 0 ? ", interrupted" : "");
+		printf("  wall  %.3fms ± %.3fms  min %.3fms  median %.3fms  p95 %.3fms  max %.3fms\n",
+			b->mean / 1e6, b->sd / 1e6, b->wall[0] / 1e6, b->median / 1e6, b->p95 / 1e6,
+			b->wall[b->nruns - 1] / 1e6);
+		printf("  cpu   user %.3fms  sys %.3fms (mean)\n", b->user / 1e6 / b->nruns, b->sys / 1e6 / b->nruns);
+		if(b->outliers || b->nonzero){
+			printf("  %d outlier%s, %d exited non-zero\n", b->outliers, b->outliers == 1 ? "" : "s", b->nonzero);
+		}
+		if(fast == NULL || b->mean < fast->mean){
+			fast = b;
+		}
+	}
+	//the others as multiples of the fastest, stddev propagated from both
+	for(i = 0; fast && ncmds > 1 && i < ncmds; i++){
+		b = &cmds[i];
+		if(b == fast || b->nruns == 0){
+			continue;
+		}
+		ratio = b->mean / fast->mean;
+		rsd = ratio * sqrt_nr((b->sd / b->mean) * (b->sd / b->mean) + (fast->sd / fast->mean) * (fast->sd / fast->mean));
+		printf("%s is %.2f ± %.2f times slower than %s\n", b->line, ratio, rsd, fast->line);
+	}
+
+	if(json && fast){
+		fp = strcmp(json, "-") ? fopen(json, "w") : stdout;
+		if(fp == NULL){
+			printf("%s: %s\n", json, strerror(errno));
+		}
+		else{
+			bench_json(fp, cmds, ncmds, runs, warmups);
+			if(fp != stdout){
+				fclose(fp);
+			}
+		}
+	}
+	builtin_status = (bad || err != 0 || fast == NULL);
+	for(i = 0; i < ncmds; i++){
+		if(cmds[i].envp != environ){
+			free(cmds[i].envp);
+		}
+		free(cmds[i].wall);
+	}
+	free(cmds);
+}
+
+/* 
+* bench_run - Start b's command once and wait for it, adding the run to b
+*
+* Returns 0, posix_spawn's error, or -1 if ctrl-c stopped it (the run is
+* killed and not counted). SIGCHLD must be blocked; the wait is a poll
+* on a pidfd so ctrl-c can break it.
+*/
+int bench_run(struct bench_cmd *b, posix_spawnattr_t *attr, posix_spawn_file_actions_t *fa){
+	struct timespec t0, t1;
+	struct rusage ru;
+	struct pollfd pfd;
+	pid_t pid;
+	int err, status;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if((err = posix_spawn(&pid, b->argv[0], fa, attr, b->argv, b->envp)) != 0){
+		return err;
+	}
+	pfd.fd = syscall(SYS_pidfd_open, pid, 0);
+	pfd.events = POLLIN;
+	//no pidfd (older kernel): wait4 alone, and ctrl-c waits for the run to end
+	while(pfd.fd >= 0 && !interrupted && poll(&pfd, 1, -1) < 0 && errno == EINTR)
+		;
+	if(interrupted){
+		kill(-pid, SIGKILL);
+	}
+	while(wait4(pid, &status, 0, &ru) < 0 && errno == EINTR)
+		;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if(pfd.fd >= 0){
+		close(pfd.fd);
+	}
+	if(interrupted){
+		return -1;
+	}
+	b->wall[b->nruns++] = (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec);
+	b->user += ru.ru_utime.tv_sec * 1000000000LL + ru.ru_utime.tv_usec * 1000LL;
+	b->sys += ru.ru_stime.tv_sec * 1000000000LL + ru.ru_stime.tv_usec * 1000LL;
+	b->nonzero += !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	return 0;
+}
+
+/* 
+* bench_stats - Mean, sample stddev, median, p95 and Tukey outliers of
+*    b's wall times, which it leaves sorted
+*
+* An outlier is more than 1.5 interquartile ranges outside the middle
+* half; a few usually mean something else was busy during the runs.
+*/
+void bench_stats(struct bench_cmd *b){
+	long long *w = b->wall, q1, q3, iqr;
+	double sum = 0, sq = 0;
+	int i, n = b->nruns;
+
+	qsort(w, n, sizeof(*w), cmp_ll);
+	for(i = 0; i < n; i++){
+		sum += w[i];
+	}
+	b->mean = sum / n;
+	for(i = 0; i < n; i++){
+		sq += (w[i] - b->mean) * (w[i] - b->mean);
+	}
+	b->sd = n > 1 ? sqrt_nr(sq / (n - 1)) : 0;
+	b->median = (w[(n - 1) / 2] + w[n / 2]) / 2;
+	b->p95 = pct_rank(w, n, 95);
+	q1 = w[(n - 1) / 4];
+	q3 = w[(n - 1) * 3 / 4];
+	iqr = q3 - q1;
+	b->outliers = 0;
+	for(i = 0; i < n; i++){
+		b->outliers += (w[i] < q1 - 3 * iqr / 2 || w[i] > q3 + 3 * iqr / 2);
+	}
+}
+
+/* bench_json - Write bench's results as one JSON object, times in ns */
+void bench_json(FILE *fp, struct bench_cmd *cmds, int ncmds, int runs, int warmups){
+	struct bench_cmd *b;
+	int i, k, shown = 0;
+
+	fprintf(fp, "{\"runs\": %d, \"warmups\": %d, \"results\": [", runs, warmups);
+	for(i = 0; i < ncmds; i++){
+		b = &cmds[i];
+		if(b->nruns == 0){
+			continue;
+		}
+		fprintf(fp, "%s\n  {\"command\": ", shown++ ? "," : "");
+		json_str(fp, b->line);
+		fprintf(fp, ", \"runs\": %d, \"mean_ns\": %.0f, \"stddev_ns\": %.0f, \"min_ns\": %lld, "
+			"\"median_ns\": %lld, \"p95_ns\": %lld, \"max_ns\": %lld, \"user_mean_ns\": %lld, "
+			"\"sys_mean_ns\": %lld, \"outliers\": %d, \"nonzero\": %d, \"times_ns\": [",
+			b->nruns, b->mean, b->sd, b->wall[0], b->median, b->p95, b->wall[b->nruns - 1],
+			b->user / b->nruns, b->sys / b->nruns, b->outliers, b->nonzero);
+		//sorted by bench_stats, not in run order
+		for(k = 0; k < b->nruns; k++){
+			fprintf(fp, k ? ", %lld" : "%lld", b->wall[k]);
+		}
+		fprintf(fp, "]}");
+	}
+	fprintf(fp, "\n]}\n");
+}
+
+/* json_str - Write s as a quoted JSON string */
+void json_str(FILE *fp, const char *s){
+	putc('"', fp);
+	for(; *s; s++){
+		if(*s == '"' || *s == '\\'){
+			fprintf(fp, "\\%c", *s);
+		}
+		else if((unsigned char)*s < 0x20){
+			fprintf(fp, "\\u%04x", *s);
+		}
+		else{
+			putc(*s, fp);
+		}
+	}
+	putc('"', fp);
+}
+
+/* sqrt_nr - Square root by Newton's method, so bench needs no -lm */
+double sqrt_nr(double x){
+	double r = x > 1 ? x : 1;
+	int i;
+
+	if(x <= 0){
+		return 0;
+	}
+	for(i = 0; i < 64; i++){
+		r = (r + x / r) / 2;
+	}
+	return r;
+}
+
+/* 
+* workq_open - Map the shared work queue /tsh-q-NAME, creating it if need be
+*/
+struct workq *workq_open(const char *name){
+	struct workq *q;
+	char path[NAME_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), WORKQ_NAME "%s", name);
+	if((fd = shm_open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600)) < 0){
+		printf("%s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	//a new segment is all zeroes, which is an empty queue; size it only once
+	q = MAP_FAILED;
+	if(ftruncate(fd, sizeof(*q)) == 0){
+		q = mmap(NULL, sizeof(*q), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if(q == MAP_FAILED){
+		printf("%s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	return q;
+}
+
+/* 
+* workq_take - Lease the oldest ready item of q to this process; returns
+*    its slot, or -1 if nothing is ready
+*
+* Slots are claimed with a compare-and-swap on their lease word, so any
+* number of runners (and enqueuers) work the queue without a lock.
+*/
+int workq_take(struct workq *q){
+	uint64_t want, best, mine = WORKQ_LEASE(getpid(), WQ_LEASED);
+	int i, slot;
+
+	do{
+		slot = -1;
+		best = UINT64_MAX;
+		for(i = 0; i < WORKQ_SLOTS; i++){
+			if((__atomic_load_n(&q->lease[i], __ATOMIC_RELAXED) & 0xff) == WQ_READY && q->ticket[i] < best){
+				best = q->ticket[i];
+				slot = i;
+			}
+		}
+		if(slot < 0){
+			return -1;
+		}
+		want = WQ_READY;
+		//lost to another runner: look again
+	}while(!__atomic_compare_exchange_n(&q->lease[slot], &want, mine, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	return slot;
+}
+
+/* 
+* workq_put - Add cmdline to q; returns 0, or -1 if every slot is taken
+*/
+int workq_put(struct workq *q, const char *cmdline){
+	uint64_t want, mine = WORKQ_LEASE(getpid(), WQ_FILLING);
+	int i;
+
+	for(i = 0; i < WORKQ_SLOTS; i++){
+		want = WQ_FREE;
+		if(__atomic_compare_exchange_n(&q->lease[i], &want, mine, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+			break;
+		}
+	}
+	if(i == WORKQ_SLOTS){
+		return -1;
+	}
+	snprintf(q->cmd[i], MAXLINE, "%s", cmdline);
+	q->ticket[i] = __atomic_fetch_add(&q->tickets, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&q->lease[i], WQ_READY, __ATOMIC_RELEASE);
+	workq_wake(q);
+	return 0;
+}
+
+/* workq_wake - Tell runners waiting in workq_wait that something is ready */
+void workq_wake(struct workq *q){
+	__atomic_fetch_add(&q->nready, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &q->nready, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* 
+* workq_wait - Sleep until q's ready count moves on from seen, a signal
+*    (a job finishing) comes in, or WORKQ_POLL passes
+*/
+void workq_wait(struct workq *q, unsigned seen){
+	struct timespec ts = {0, WORKQ_POLL};
+
+	syscall(SYS_futex, &q->nready, FUTEX_WAIT, seen, &ts, NULL, 0);
+}
+
+/* 
+* workq_recover - Requeue the items of runners that died holding them;
+*    returns how many
+*
+* A lease names its runner's pid, so a lease whose pid is gone is dead.
+* The item may have run partly: items run at least once, not exactly once.
+*/
+int workq_recover(struct workq *q){
+	uint64_t lease;
+	pid_t owner;
+	int i, state, n = 0;
+
+	for(i = 0; i < WORKQ_SLOTS; i++){
+		lease = __atomic_load_n(&q->lease[i], __ATOMIC_RELAXED);
+		owner = lease >> 32;
+		state = lease & 0xff;
+		if(state == WQ_FREE || state == WQ_READY || owner == getpid()){
+			continue;
+		}
+		if(kill(owner, 0) == 0 || errno != ESRCH){
+			continue;
+		}
+		//died mid-enqueue: the slot was never ready, so just free it
+		if(state == WQ_FILLING){
+			__atomic_compare_exchange_n(&q->lease[i], &lease, WQ_FREE, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		}
+		else if(__atomic_compare_exchange_n(&q->lease[i], &lease, WQ_READY, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+			n++;
+		}
+	}
+	if(n){
+		workq_wake(q);
+	}
+	return n;
+}
+
+/* 
+* do_enqueue - Execute the builtin enqueue command: enqueue NAME [cmd args...]
+*
+* Adds the command to the shared queue NAME for drain runners to pick
+* up; with no command, prints how many items are ready and running.
+*/
+void do_enqueue(char **argv){
+	struct workq *q;
+	char line[MAXLINE];
+	uint64_t lease;
+	size_t len = 0;
+	int i, ready = 0, leased = 0;
+
+	if(argv[1] == NULL){
+		printf("usage: enqueue NAME [cmd [args...]]\n");
+		return;
+	}
+	if((q = workq_open(argv[1])) == NULL){
+		return;
+	}
+	if(argv[2] == NULL){
+		for(i = 0; i < WORKQ_SLOTS; i++){
+			lease = __atomic_load_n(&q->lease[i], __ATOMIC_RELAXED);
+			ready += (lease & 0xff) == WQ_READY;
+			leased += (lease & 0xff) == WQ_LEASED;
+		}
+		printf("%s: %d ready, %d running, %llu done\n", argv[1], ready, leased, (unsigned long long)q->ndone);
+		munmap(q, sizeof(*q));
+		return;
+	}
+	//put the words back together, quoting the ones parseline would split
+	line[0] = '\0';
+	for(i = 2; argv[i] && len < sizeof(line); i++){
+		len += snprintf(line + len, sizeof(line) - len, strpbrk(argv[i], " \t") ? "%s'%s'" : "%s%s", i > 2 ? " " : "", argv[i]);
+	}
+	if(len >= sizeof(line)){
+		printf("enqueue: command too long\n");
+	}
+	else if(workq_put(q, line) < 0){
+		printf("enqueue: %s is full (%d items)\n", argv[1], WORKQ_SLOTS);
+	}
+	munmap(q, sizeof(*q));
+}
+
+/* 
+* do_drain - Execute the builtin drain command: drain NAME [-j slots] [-f]
+*
+* Runs the items of the shared queue NAME as background jobs, at most
+* slots at a time, taking another as each finishes. Several shells can
+* drain one queue. Returns when the queue is empty and its own jobs are
+* done; with -f it waits for more work until ctrl-c, after which it
+* finishes what it is running. Items of runners that died are requeued.
+*/
+void do_drain(char **argv){
+	struct workq *q;
+	struct tsh_result r;
+	char line[MAXLINE + 4], *end = "";
+	int slot[MAXJOBS];
+	pid_t pid[MAXJOBS];
+	unsigned long ndone;
+	unsigned seen;
+	int i, n, nslots = 1, follow = 0, nlive = 0, ran = 0, recovered = 0;
+
+	for(i = 2; argv[1] && argv[i]; i++){
+		if(!strcmp(argv[i], "-f")){
+			follow = 1;
+		}
+		else if(!strcmp(argv[i], "-j") && argv[i+1]){
+			nslots = strtol(argv[++i], &end, 10);
+		}
+		else{
+			break;
+		}
+	}
+	if(argv[1] == NULL || argv[i] || *end || nslots < 1){
+		printf("usage: drain NAME [-j slots] [-f]\n");
+		return;
+	}
+	if((q = workq_open(argv[1])) == NULL){
+		return;
+	}
+	//every item is a job in our list
+	nslots = (nslots < MAXJOBS) ? nslots : MAXJOBS;
+	interrupted = 0;
+
+	while(1){
+		//an item's job gone from the job list is an item done
+		ndone = ctx->ndone;
+		for(i = 0; i < nlive; ){
+			if(getjobpid(ctx->jobs, pid[i]) != NULL){
+				i++;
+				continue;
+			}
+			__atomic_store_n(&q->lease[slot[i]], WQ_FREE, __ATOMIC_RELEASE);
+			__atomic_fetch_add(&q->ndone, 1, __ATOMIC_RELAXED);
+			nlive--;
+			slot[i] = slot[nlive];
+			pid[i] = pid[nlive];
+		}
+		seen = __atomic_load_n(&q->nready, __ATOMIC_ACQUIRE);
+
+		while(!interrupted && nlive < nslots && (n = workq_take(q)) >= 0){
+			snprintf(line, sizeof(line), "%s &\n", q->cmd[n]);
+			r.pid = 0;
+			eval(line, &r);
+			ran++;
+			//a builtin, or a line that didn't launch, is over already
+			if(r.pid == 0 || getjobpid(ctx->jobs, r.pid) == NULL){
+				__atomic_store_n(&q->lease[n], WQ_FREE, __ATOMIC_RELEASE);
+				__atomic_fetch_add(&q->ndone, 1, __ATOMIC_RELAXED);
+				continue;
+			}
+			slot[nlive] = n;
+			pid[nlive++] = r.pid;
+		}
+		fflush(stdout);
+		if(nlive == 0 && (interrupted || !follow)){
+			//nothing of ours is out; pick up anything a dead runner left before leaving
+			if(interrupted || (n = workq_recover(q)) == 0){
+				break;
+			}
+			recovered += n;
+			continue;
+		}
+		if(nlive < nslots){
+			recovered += workq_recover(q);
+		}
+		//a job that ended since the sweep above would otherwise wait out the poll
+		if(ctx->ndone == ndone){
+			workq_wait(q, seen);
+		}
+		tsh_events(ctx);
+	}
+	printf("drain: %s: ran %d item%s", argv[1], ran, ran == 1 ? "" : "s");
+	if(recovered){
+		printf(" (requeued from dead runners: %d)", recovered);
+	}
+	printf("\n");
+	munmap(q, sizeof(*q));
+}
+
+/* 
+* do_enable - Execute the builtin enable command
+*
+*     enable -f plugin.so name...   make each name a builtin from plugin.so
+*     enable -d name                forget a loadable builtin
+*     enable                        list them
+*
+* Nothing is loaded here: the shared object is opened the first time
+* one of its builtins runs, so an rc file can enable many for free.
+*/
+void do_enable(char **argv){
+	struct plugin *pl;
+	int i;
+
+	if(argv[1] == NULL){
+		for(i = 0; i < nplugins; i++){
+			printf("enable -f %s %s%s\n", plugins[i].path, plugins[i].name, plugins[i].fn ? "" : " (not loaded)");
+		}
+		return;
+	}
+	if(!strcmp(argv[1], "-d") && argv[2]){
+		if((pl = find_plugin(argv[2])) == NULL){
+			printf("enable: %s: not a loadable builtin\n", argv[2]);
+			return;
+		}
+		//the object stays mapped: other names may still use it
+		free(pl->path);
+		*pl = plugins[--nplugins];
+		return;
+	}
+	if(strcmp(argv[1], "-f") || argv[2] == NULL || argv[3] == NULL){
+		printf("usage: enable [-f plugin.so name... | -d name]\n");
+		return;
+	}
+	for(i = 3; argv[i]; i++){
+		if((pl = find_plugin(argv[i])) == NULL){
+			if(nplugins == MAXPLUGINS){
+				printf("enable: too many loadable builtins (max %d)\n", MAXPLUGINS);
+				return;
+			}
+			pl = &plugins[nplugins++];
+		}
+		else{
+			free(pl->path);
+		}
+		snprintf(pl->name, sizeof(pl->name), "%s", argv[i]);
+		pl->path = strdup(argv[2]);
+		pl->fn = NULL;
+	}
+}
+
+/* find_plugin - The loadable builtin called name, or NULL */
+struct plugin *find_plugin(const char *name){
+	int i;
+
+	for(i = 0; i < nplugins; i++){
+		if(!strcmp(plugins[i].name, name)){
+			return &plugins[i];
+		}
+	}
+	return NULL;
+}
+
+/* 
+* run_plugin - Run loadable builtin pl with argv, loading it first if
+*    this is its first use; returns its exit status
+*
+* Its <, > and >> redirections (and dups among fds 0-2) become the fds
+* it is handed, so the shell's own fds are never touched.
+*/
+int run_plugin(struct plugin *pl, char **argv){
+	struct tsh_builtin_api api;
+	struct redir rd;
+	void *dl;
+	int *abi;
+	char sym[sizeof(pl->name) + 16];
+	int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+	int opened[3] = {-1, -1, -1};
+	int i, j, n, status = 1;
+
+	if(pl->fn == NULL){
+		if((dl = dlopen(pl->path, RTLD_NOW|RTLD_LOCAL)) == NULL){
+			printf("%s: %s\n", pl->name, dlerror());
+			return 1;
+		}
+		snprintf(sym, sizeof(sym), "tsh_builtin_%s", pl->name);
+		abi = dlsym(dl, "tsh_plugin_abi");
+		if(abi == NULL || *abi != TSH_PLUGIN_ABI){
+			printf("%s: %s: not built for this shell's plugin ABI (%d)\n", pl->name, pl->path, TSH_PLUGIN_ABI);
+			dlclose(dl);
+			return 1;
+		}
+		if((pl->fn = (tsh_builtin_fn *)dlsym(dl, sym)) == NULL){
+			printf("%s: %s: no %s\n", pl->name, pl->path, sym);
+			dlclose(dl);
+			return 1;
+		}
+	}
+
+	for(i = j = 0; argv[i]; i += n){
+		if((n = parse_redir(argv, i, &rd)) == 0){
+			argv[j++] = argv[i];
+			n = 1;
+			continue;
+		}
+		if(n < 0 || rd.fd > 2 || (rd.flags == -1 && (rd.dupfd < 0 || rd.dupfd > 2))){
+			printf("%s: %s: unsupported redirection for a loadable builtin\n", pl->name, argv[i]);
+			goto out;
+		}
+		if(rd.flags == -1){
+			fds[rd.fd] = fds[rd.dupfd];
+			continue;
+		}
+		if(opened[rd.fd] >= 0){
+			close(opened[rd.fd]);
+		}
+		if((opened[rd.fd] = open(rd.path, rd.flags|O_CLOEXEC, 0666)) < 0){
+			printf("%s: %s\n", rd.path, strerror(errno));
+			goto out;
+		}
+		fds[rd.fd] = opened[rd.fd];
+	}
+	argv[j] = NULL;
+
+	api.abi = TSH_PLUGIN_ABI;
+	api.in = fds[0];
+	api.out = fds[1];
+	api.err = fds[2];
+	api.getenv = getenv;
+	api.setenv = plugin_setenv;
+	//our buffered output goes first if it shares an fd with the plugin's
+	fflush(stdout);
+	status = pl->fn(j, argv, &api);
+out:
+	for(i = 0; i < 3; i++){
+		if(opened[i] >= 0){
+			close(opened[i]);
+		}
+	}
+	return status;
+}
+
+/* plugin_setenv - The api's setenv: set name, or unset it if value is NULL */
+int plugin_setenv(const char *name, const char *value){
+	int rc;
+
+	rc = value ? setenv(name, value, 1) : unsetenv(name);
+	env_changed();
+	return rc;
+}
+
+/* 
+* do_group - Execute the builtin group command
+*
+*     group create NAME    a group for @group=NAME jobs to join
+*     group delete NAME    drop it (its jobs carry on, ungrouped)
+*     group                list groups with their members' states
+*
+* fg, bg, kill and wait take @NAME to act on every member at once.
+*/
+void do_group(char **argv){
+	struct job_group *g;
+	sigset_t mask, prev;
+	int i;
+
+	if(argv[1] == NULL){
+		list_groups();
+		return;
+	}
+	if(argv[2] == NULL || (strcmp(argv[1], "create") && strcmp(argv[1], "delete"))){
+		printf("usage: group [create NAME | delete NAME]\n");
+		return;
+	}
+	g = find_group(argv[2]);
+	if(argv[1][0] == 'c'){
+		if(g != NULL){
+			printf("group: %s already exists\n", argv[2]);
+			return;
+		}
+		for(i = 0; i < MAXGROUPS && groups[i].name[0]; i++)
+			;
+		if(i == MAXGROUPS || strlen(argv[2]) >= sizeof(groups[i].name)){
+			printf("group: can't create %s (at most %d groups, names under %d bytes)\n", argv[2], MAXGROUPS, (int)sizeof(groups[i].name));
+			return;
+		}
+		g = &groups[i];
+		strcpy(g->name, argv[2]);
+		g->first = -1;
+		g->nmembers = g->ndone = g->nfailed = 0;
+		return;
+	}
+	if(g == NULL){
+		printf("group: %s: no such group\n", argv[2]);
+		return;
+	}
+	//the handler unlinks members as they finish
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &prev);
+	while(g->first >= 0){
+		group_leave(&ctx->jobs[g->first]);
+	}
+	g->name[0] = '\0';
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/* find_group - The job group called name, or NULL */
+struct job_group *find_group(const char *name){
+	int i;
+
+	for(i = 0; i < MAXGROUPS; i++){
+		if(groups[i].name[0] && !strcmp(groups[i].name, name)){
+			return &groups[i];
+		}
+	}
+	return NULL;
+}
+
+/* 
+* group_join - Put job in group g (SIGCHLD blocked)
+*
+* Members are a doubly linked list through their job slots, so joining
+* and leaving are O(1) and a group op only visits its own members.
+*/
+void group_join(struct job_t *job, struct job_group *g){
+	int slot = job - ctx->jobs;
+
+	job->group = g - groups;
+	job->gprev = -1;
+	job->gnext = g->first;
+	if(g->first >= 0){
+		ctx->jobs[g->first].gprev = slot;
+	}
+	g->first = slot;
+	g->nmembers++;
+}
+
+/* group_leave - Take job out of its group, if any (SIGCHLD blocked or handler) */
+void group_leave(struct job_t *job){
+	struct job_group *g;
+
+	if(job->group < 0){
+		return;
+	}
+	g = &groups[job->group];
+	if(job->gprev >= 0){
+		ctx->jobs[job->gprev].gnext = job->gnext;
+	}
+	else{
+		g->first = job->gnext;
+	}
+	if(job->gnext >= 0){
+		ctx->jobs[job->gnext].gprev = job->gprev;
+	}
+	g->nmembers--;
+	job->group = job->gprev = job->gnext = -1;
+}
+
+/* list_groups - group_status every group */
+void list_groups(void){
+	int i;
+
+	for(i = 0; i < MAXGROUPS; i++){
+		if(groups[i].name[0]){
+			group_status(&groups[i]);
+		}
+	}
+}
+
+/* group_status - Print one line on group g: its members by state, and how the finished ones did */
+void group_status(struct job_group *g){
+	int j, n[4] = {0, 0, 0, 0};
+
+	for(j = g->first; j >= 0; j = ctx->jobs[j].gnext){
+		n[ctx->jobs[j].state & 3]++;
+	}
+	printf("@%s: %d running, %d stopped, %d done", g->name, n[BG] + n[FG], n[ST], g->ndone);
+	if(g->nfailed){
+		printf(" (%d failed)", g->nfailed);
+	}
+	printf("\n");
+}
+
+/* 
+* do_group_bgfg - fg or bg @NAME: continue every member of group g in
+*    one pass, then for fg wait until none is left in the foreground
+*
+* All of them are foreground jobs meanwhile, so ctrl-c and ctrl-z reach
+* every one.
+*/
+void do_group_bgfg(char **argv, struct job_group *g){
+	struct job_t *job;
+	sigset_t mask, prev;
+	int j, fg = !strcmp(argv[0], "fg");
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &prev);
+	if(g->first < 0){
+		printf("%s: @%s has no jobs\n", argv[0], g->name);
+	}
+	for(j = g->first; j >= 0; j = job->gnext){
+		job = &ctx->jobs[j];
+		job->state = fg ? FG : BG;
+		shm_publish(job);
+		if(!fg){
+			printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
 		}
-		else if (!strcmp(argv[i],">")) {
-			/* do stuff for output redirection here */
-			int fdout = open(argv[i+1], O_WRONLY|O_CREAT,  S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
-			//error handling
-			if(fdout < 0){
-				perror("open");
-				return;
+		kill(-job->pid, SIGCONT);
+	}
+	//the handler reaps or stops members; each unlinks or leaves FG as it goes
+	while(fg){
+		for(j = g->first; j >= 0 && ctx->jobs[j].state != FG; j = ctx->jobs[j].gnext)
+			;
+		if(j < 0){
+			break;
+		}
+		sigsuspend(&prev);
+	}
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/* 
+* jobs_named - The jobs an argument of kill or wait names: a PID,
+*    %jobid or @group; returns how many were put in out (at most
+*    MAXJOBS), or -1 after saying why there are none
+*/
+int jobs_named(char *cmd, char *arg, struct job_t **out){
+	struct job_group *g;
+	char *targv[3] = {cmd, arg, NULL};
+	int j, n = 0;
+
+	if(arg[0] != '@'){
+		return (out[0] = getjobarg(targv)) ? 1 : -1;
+	}
+	if((g = find_group(arg + 1)) == NULL){
+		printf("%s: %s: no such group\n", cmd, arg);
+		return -1;
+	}
+	for(j = g->first; j >= 0; j = ctx->jobs[j].gnext){
+		out[n++] = &ctx->jobs[j];
+	}
+	return n;
+}
+
+/* 
+* do_kill - Execute the builtin kill command: kill [-SIG] PID|%jobid|@group...
+*
+* Signals each job's whole process group (SIGTERM by default). A
+* stopped job is continued too, so it can act on the signal, unless the
+* signal is KILL or another stop signal; continued (or sent CONT) it is
+* a background job from then on.
+*/
+void do_kill(char **argv){
+	struct job_t *jobs[MAXJOBS];
+	sigset_t mask, prev;
+	char *name, *end;
+	int i = 1, k, n, sig = SIGTERM;
+
+	if(argv[1] && argv[1][0] == '-'){
+		name = argv[1] + 1;
+		name += strncmp(name, "SIG", 3) ? 0 : 3;
+		sig = strtol(name, &end, 10);
+		if(*end){
+			for(sig = 1; sig < NSIG && (sigabbrev_np(sig) == NULL || strcmp(sigabbrev_np(sig), name)); sig++)
+				;
+		}
+		if(sig < 1 || sig >= NSIG){
+			printf("kill: %s: invalid signal specification\n", argv[1]);
+			return;
+		}
+		i++;
+	}
+	if(argv[i] == NULL){
+		printf("usage: kill [-SIG] PID|%%jobid|@group...\n");
+		return;
+	}
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &prev);
+	for(; argv[i]; i++){
+		//a pid outside the job list is still fair game
+		if(isdigit(*argv[i]) && getjobpid(ctx->jobs, atoi(argv[i])) == NULL){
+			if(kill(atoi(argv[i]), sig) < 0){
+				printf("(%s): %s\n", argv[i], strerror(errno));
 			}
-			dup2(fdout, STDOUT_FILENO);
-			//error handling
-			if(close(fdout) < 0){
-				perror("close");
-				return;
+			continue;
+		}
+		n = jobs_named(argv[0], argv[i], jobs);
+		for(k = 0; k < n; k++){
+			kill(-jobs[k]->pid, sig);
+			//another stop signal leaves a stopped job as it is
+			if(jobs[k]->state != ST || sig == SIGKILL || sig == SIGSTOP || sig == SIGTSTP ||
+			   sig == SIGTTIN || sig == SIGTTOU){
+				continue;
+			}
+			//continue it so it sees the signal; either way it runs in the background now
+			if(sig != SIGCONT){
+				kill(-jobs[k]->pid, SIGCONT);
 			}
-			
-			/* the line below cuts argv short -- this removes the > and whatever follows from argv */
-			argv[i]=NULL;
+			jobs[k]->state = BG;
+			shm_publish(jobs[k]);
 		}
 	}
+	sigprocmask(SIG_SETMASK, &prev, NULL);
 }
 
 /* 
-* do_bgfg - Execute the builtin bg and fg commands
+* do_wait - Execute the builtin wait command: wait [PID|%jobid|@group...]
+*
+* Waits for the named jobs (default: every background job) to finish;
+* stopped ones don't count as running. ctrl-c gives up waiting. For a
+* group, reports how its members ended; the status is 1 if any failed.
 */
-void do_bgfg(char **argv){
+void do_wait(char **argv){
+	struct job_t *jobs[MAXJOBS];
+	struct job_group *g;
+	pid_t pids[MAXJOBS];
+	sigset_t mask, prev;
+	int i, k, n, npids = 0;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &prev);
+	for(i = 0; argv[1] == NULL && i < MAXJOBS; i++){
+		if(ctx->jobs[i].state == BG){
+			pids[npids++] = ctx->jobs[i].pid;
+		}
+	}
+	for(i = 1; argv[i]; i++){
+		n = jobs_named(argv[0], argv[i], jobs);
+		for(k = 0; k < n && npids < MAXJOBS; k++){
+			pids[npids++] = jobs[k]->pid;
+		}
+	}
+
+	//a waited-for job is done once its pid has left the list
+	interrupted = 0;
+	for(k = 0; k < npids && !interrupted; ){
+		if((jobs[0] = getjobpid(ctx->jobs, pids[k])) == NULL || jobs[0]->state == ST){
+			k++;
+			continue;
+		}
+		sigsuspend(&prev);
+	}
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+
+	for(i = 1; argv[i]; i++){
+		if(argv[i][0] == '@' && (g = find_group(argv[i] + 1)) != NULL){
+			group_status(g);
+			builtin_status |= (g->nfailed > 0);
+		}
+	}
+}
+
+/* 
+* getjobarg - Find the job named by argv[1], a PID or %jobid; prints
+*    the reason and returns NULL if there isn't one
+*/
+struct job_t *getjobarg(char **argv){
 	//jobs can be recognized with PID or JID
 	pid_t pid;
 	int jid;
@@ -405,7 +5908,7 @@ void do_bgfg(char **argv){
 	//handle no input
 	if(argv[1] == NULL){
 		printf("%s command requires PID or %%jobid argument\n", argv[0]);
-		return;
+		return NULL;
 	}
 
 	//jid
@@ -413,32 +5916,56 @@ void do_bgfg(char **argv){
 		//jid; get rid of % by referencing next index; atoi(ascii to integer)
 		jid = atoi(&argv[1][1]);
 		//now convert to the job
-		this_job = getjobjid(jobs,jid);
+		this_job = getjobjid(ctx->jobs,jid);
 		//error handling
 		if(this_job == NULL){
 			printf("%s: No such job\n",argv[1]);
-			return;
+			return NULL;
 		}
-
-		//and store the pid
-		pid = this_job->pid;
 	}
 	//pid
 	else if(isdigit(*argv[1])){
 		//pid; store in var
 		pid = atoi(argv[1]); 
 		//save job with given function
-		this_job = getjobpid(jobs, pid);
+		this_job = getjobpid(ctx->jobs, pid);
 		if(this_job == NULL){
 			printf("(%d): No such process\n",pid);
-			return;
+			return NULL;
 		}
 	}
 	/*handle bad input*/
 	else{
 		printf("%s: argument must be a PID or %%jobid\n",argv[0]);
+		return NULL;
+	}
+	return this_job;
+}
+
+/* 
+* do_bgfg - Execute the builtin bg and fg commands
+*/
+void do_bgfg(char **argv){
+	//jobs can be recognized with PID or JID
+	pid_t pid;
+	//hold current job to look at
+	struct job_t *this_job;
+	struct job_group *g;
+
+	//@name: every job in the group at once
+	if(argv[1] && argv[1][0] == '@'){
+		if((g = find_group(argv[1] + 1)) == NULL){
+			printf("%s: %s: no such group\n", argv[0], argv[1]);
+		}
+		else{
+			do_group_bgfg(argv, g);
+		}
+		return;
+	}
+	if((this_job = getjobarg(argv)) == NULL){
 		return;
 	}
+	pid = this_job->pid;
 
 	/*see if "fg" or "bg' was used (built in)*/
 	
@@ -446,6 +5973,7 @@ void do_bgfg(char **argv){
 	if(!strcmp("bg", argv[0])){
 		//change defined state
 		this_job->state = BG;
+		shm_publish(this_job);
 		//print format information
 		printf("[%d] (%d) %s", pid2jid(pid), pid, (this_job->cmdline));
 		//kill group with SIGCONT
@@ -456,39 +5984,639 @@ void do_bgfg(char **argv){
 	else if(!strcmp("fg", argv[0])){
 		//switch state
 		this_job->state = FG;
+		shm_publish(this_job);
 		//kill before waitfg
 		kill(-pid, SIGCONT);
 		//and run wait fg since its now in fg
 		waitfg(pid);
 	}
-	
-	return;
-}//end do_bgfg
+	
+	return;
+}//end do_bgfg
+
+/* 
+* waitfg - Block until process pid is no longer the foreground process
+*/
+void waitfg(pid_t pid){
+	/*don't call waitpid; let sigchld_handler reap and wake us*/
+	
+	//pointer to current job
+	struct job_t* currentjob;
+	sigset_t mask, prev;
+
+	//block SIGCHLD so the state test and the suspend can't race the handler
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &prev);
+
+	//check jobs list getjobpid()
+	currentjob = getjobpid(ctx->jobs, pid);
+
+	//an attached job isn't our child, so no SIGCHLD is coming for it
+	if(currentjob && currentjob->pidfd >= 0){
+		sigprocmask(SIG_SETMASK, &prev, NULL);
+		waitfg_adopted(currentjob);
+		return;
+	}
+
+	//the handler clears the slot (pid 0) or marks it stopped; either ends the wait
+	//(sleep(1) here used to cost a full second per foreground command)
+	while(currentjob && currentjob->pid == pid && currentjob->state == FG){
+		//a job off our stdin leaves it to us: read the next lines while it runs
+		if(!currentjob->readahead || input_loop == NULL || ev_readahead(input_loop, &prev) < 0){
+			sigsuspend(&prev);
+		}
+	}
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+	return;
+}
+
+/* 
+* source_file - Evaluate every line of a script file in the current shell
+*
+* The file's text comes from load_script, so sourcing a file again (or
+* running it from a forked child, which inherits the cache) costs one
+* stat instead of open, fstat, read and close. Returns -1 if the file
+* can't be read (errno says why), -2 if scripts are nested too deep,
+* else the wait status of the last command run.
+*/
+int source_file(const char *path){
+	static int depth = 0;
+	struct script_t *sc;
+	char *line, *end;
+	char cmdline[MAXLINE];
+	size_t len;
+	int status = 0;
+
+	//a script that sources itself would otherwise recurse until the stack runs out
+	if(depth >= MAXSOURCE){
+		printf("%s: nesting too deep\n", path);
+		return -2;
+	}
+	if((sc = load_script(path)) == NULL){
+		return -1;
+	}
+	sc->inuse++;
+	depth++;
+
+	//eval expects the newline fgets would have left, so add one per line
+	for(line = sc->text; line < sc->text + sc->len; line = end){
+		end = memchr(line, '\n', sc->text + sc->len - line);
+		len = end ? (size_t)(end - line) : (size_t)(sc->text + sc->len - line);
+		end = end ? end + 1 : line + len;
+		//blank lines, comments and a #! line
+		if(len == 0 || line[0] == '#'){
+			continue;
+		}
+		if(len >= MAXLINE - 1){
+			printf("%s: line too long\n", path);
+			continue;
+		}
+		memcpy(cmdline, line, len);
+		cmdline[len] = '\n';
+		cmdline[len+1] = '\0';
+		status = eval(cmdline, NULL);
+	}
+	depth--;
+	sc->inuse--;
+	if(sc->uncached){
+		free(sc->text);
+		free(sc);
+	}
+	return status;
+}
+
+/* 
+* load_script - Return the cached text of a script, reading it if the
+*    file is new or has changed since it was cached
+*/
+struct script_t *load_script(const char *path){
+	static int next = 0;
+	struct stat st;
+	struct script_t *sc;
+	char *text;
+	ssize_t n;
+	int fd, i;
+
+	if(stat(path, &st) < 0){
+		return NULL;
+	}
+	for(i = 0; i < MAXSCRIPTS; i++){
+		sc = &scripts[i];
+		if(sc->text && sc->dev == st.st_dev && sc->ino == st.st_ino &&
+		   sc->size == st.st_size && sc->mtime.tv_sec == st.st_mtim.tv_sec &&
+		   sc->mtime.tv_nsec == st.st_mtim.tv_nsec){
+			return sc;
+		}
+	}
+
+	if((fd = open(path, O_RDONLY)) < 0){
+		return NULL;
+	}
+	if((text = malloc(st.st_size + 1)) == NULL){
+		close(fd);
+		return NULL;
+	}
+	n = read(fd, text, st.st_size);
+	close(fd);
+	if(n < 0){
+		free(text);
+		return NULL;
+	}
+	text[n] = '\0';
+
+	//round-robin replacement, skipping scripts that are still running
+	for(i = 0; i < MAXSCRIPTS && scripts[next].inuse; i++){
+		next = (next + 1) % MAXSCRIPTS;
+	}
+	if(scripts[next].inuse){
+		//all slots busy (deep nesting): this run gets a copy of its own
+		if((sc = calloc(1, sizeof(*sc))) == NULL){
+			free(text);
+			return NULL;
+		}
+		sc->uncached = 1;
+	}
+	else{
+		sc = &scripts[next];
+		next = (next + 1) % MAXSCRIPTS;
+		free(sc->text);
+	}
+	sc->dev = st.st_dev;
+	sc->ino = st.st_ino;
+	sc->size = st.st_size;
+	sc->mtime = st.st_mtim;
+	sc->text = text;
+	sc->len = n;
+	return sc;
+}
+
+/* 
+* run_script_child - Run a text file without a #! line as a tsh script
+*
+* Called in a child whose execve failed with ENOEXEC. The child already
+* has the shell (and its script cache) in memory, so this replaces an
+* exec of /bin/sh and a second shell start. Never returns.
+*/
+void run_script_child(const char *path){
+	int status, sig;
+
+	//the child is a fresh shell: no jobs, no traps, and hands off the parent's wakeups
+	initjobs(ctx->jobs);
+	ctx->nextjid = 1;
+	ctx->nevents = 0;
+	ctx->wakefd = -1;
+	for(sig = 0; sig <= NSIG; sig++){
+		ctx->traps[sig] = NULL;
+	}
+
+	status = source_file(path);
+	fflush(stdout);
+	if(status == -2){
+		exit(126);
+	}
+	if(status < 0){
+		printf("%s: Command not found.\n", path);
+		exit(127);
+	}
+	exit(status_code(status));
+}
+
+/* 
+* load_rc - Run $TSHRC, or ~/.tshrc, if it exists (interactive shells only)
+*/
+void load_rc(void){
+	char path[MAXLINE];
+	char *file = getenv("TSHRC");
+	char *home = getenv("HOME");
+
+	if(file == NULL){
+		if(home == NULL){
+			return;
+		}
+		snprintf(path, sizeof(path), "%s/%s", home, RCFILE);
+		file = path;
+	}
+	//a missing rc file is normal, so stay quiet
+	source_file(file);
+}
+
+/*******************
+ * Input event loop
+ *******************/
+
+/* 
+* ev_init - Set up the input loop on stdin and wakefd
+*
+* Returns the backend actually in use: asking for io_uring on a kernel
+* (or sandbox) without it quietly gets epoll.
+*/
+int ev_init(struct evloop *ev, int backend, int wakefd){
+	struct epoll_event e;
+
+	memset(ev, 0, sizeof(*ev));
+	ev->wakefd = wakefd;
+	ev->epfd = ev->ringfd = -1;
+
+	if(backend == EV_URING && uring_setup(ev) == 0){
+		ev->backend = EV_URING;
+		return EV_URING;
+	}
+
+	ev->backend = EV_EPOLL;
+	if((ev->epfd = fd_high(epoll_create1(EPOLL_CLOEXEC))) < 0){
+		unix_error("epoll_create1 error");
+	}
+	e.events = EPOLLIN;
+	e.data.fd = STDIN_FILENO;
+	//regular files can't be polled (EPERM), but reads on them never block anyway
+	if(epoll_ctl(ev->epfd, EPOLL_CTL_ADD, STDIN_FILENO, &e) < 0){
+		ev->stdin_file = 1;
+	}
+	e.data.fd = wakefd;
+	if(wakefd >= 0){
+		epoll_ctl(ev->epfd, EPOLL_CTL_ADD, wakefd, &e);
+	}
+	return EV_EPOLL;
+}
+
+/* 
+* read_line - Hand out the next line of stdin, fgets-style
+*
+* A line longer than MAXLINE-2 is dropped with a message and comes out
+* as a blank line. A last line without a newline gets one. cmdline is ""
+* at end of input; returns -1 on a read error.
+*/
+int read_line(struct evloop *ev, char *cmdline){
+	char *nl;
+	int len, n, toolong = 0;
+
+	if(ctx->stdin_moved){
+		ev_restart(ev);
+	}
+	for(;;){
+		nl = memchr(ev->inbuf, '\n', ev->inlen);
+		if(nl && !toolong && nl - ev->inbuf <= MAXLINE - 2){
+			len = nl - ev->inbuf + 1;
+			break;
+		}
+		//a line too long to run, whole in inbuf or the rest of one; run nothing rather than its pieces
+		if(nl){
+			ev->inlen -= nl - ev->inbuf + 1;
+			memmove(ev->inbuf, nl + 1, ev->inlen);
+			printf("Line too long (max %d characters)\n", MAXLINE - 2);
+			strcpy(cmdline, "\n");
+			return 1;
+		}
+		if(ev->inlen > MAXLINE - 2){
+			toolong = 1;
+			ev->inlen = 0;
+		}
+		if((n = ev_fill(ev)) < 0){
+			return -1;
+		}
+		if(n == 0 && toolong){
+			ev->inlen = 0;
+			printf("Line too long (max %d characters)\n", MAXLINE - 2);
+			strcpy(cmdline, "\n");
+			return 1;
+		}
+		if(n == 0){
+			//EOF: flush a partial last line, then report the end
+			len = ev->inlen;
+			break;
+		}
+	}
+	memcpy(cmdline, ev->inbuf, len);
+	ev->inlen -= len;
+	memmove(ev->inbuf, ev->inbuf + len, ev->inlen);
+	if(len && cmdline[len-1] != '\n'){
+		cmdline[len++] = '\n';
+	}
+	cmdline[len] = '\0';
+	return len;
+}
+
+/* 
+* ev_fill - Wait for more stdin, running tsh_events() on every wakeup
+*
+* Returns the number of bytes appended to inbuf, 0 at EOF, -1 on error.
+*/
+int ev_fill(struct evloop *ev){
+	int before = ev->inlen, n;
+
+	//a read ahead already saw the end; don't wait on a terminal for a second ctrl-d
+	if(ev->eof){
+		return 0;
+	}
+	n = ev->backend == EV_URING ? uring_fill(ev) : epoll_fill(ev);
+	if(n >= 0){
+		rec_event(REC_INPUT, ev->inbuf + before, ev->inlen - before);
+	}
+	return n;
+}
+
+/* 
+* ev_restart - exec <file swapped stdin under us: drop what was buffered
+*    from the old stdin and, for epoll, register the new one
+*/
+void ev_restart(struct evloop *ev){
+	unsigned long nsyscalls = ev->nsyscalls;
+
+	ctx->stdin_moved = 0;
+	ev->inlen = 0;
+	ev->eof = 0;
+	//io_uring names fd 0 afresh in every read, so only epoll holds on to the old file
+	if(ev->backend == EV_EPOLL){
+		close(ev->epfd);
+		ev_init(ev, EV_EPOLL, ev->wakefd);
+		ev->nsyscalls = nsyscalls;
+	}
+}
+
+/* 
+* ev_readahead - Read stdin into inbuf while the foreground job runs
+*
+* For jobs that don't read the shell's stdin: by the time the job is
+* done its successors are already in memory. Called with SIGCHLD
+* blocked, like sigsuspend, and prev is the mask to wait under. Returns
+* after a signal or one read, so the caller rechecks the job; -1 if
+* there is nothing to read ahead (full buffer, end of input) and the
+* caller should just sigsuspend.
+*/
+int ev_readahead(struct evloop *ev, sigset_t *prev){
+	struct pollfd pfd;
+	int n;
+
+	if(ev->eof || ev->inlen == INBUFSIZE || ctx->stdin_moved){
+		return -1;
+	}
+	//regular files are always readable (and can't be polled under epoll)
+	if(!ev->stdin_file){
+		pfd.fd = STDIN_FILENO;
+		pfd.events = POLLIN;
+		n = ppoll(&pfd, 1, NULL, prev);
+		ev->nsyscalls++;
+		if(n <= 0){
+			return 0;
+		}
+	}
+	n = read(STDIN_FILENO, ev->inbuf + ev->inlen, INBUFSIZE - ev->inlen);
+	ev->nsyscalls++;
+	if(n >= 0){
+		rec_event(REC_INPUT, ev->inbuf + ev->inlen, n);
+	}
+	if(n == 0){
+		ev->eof = 1;
+	}
+	else if(n > 0){
+		ev->inlen += n;
+	}
+	return 0;
+}
+
+/* 
+* ev_giveback - Put buffered, unread input back into a seekable stdin
+*
+* Before a job that reads the shell's stdin starts, so it sees the lines
+* after its own as sh would give them to it. A pipe can't be rewound;
+* there the job just starts after what the shell has buffered.
+*/
+void ev_giveback(struct evloop *ev){
+	if(ev->inlen == 0 || ctx->stdin_moved){
+		return;
+	}
+	if(lseek(STDIN_FILENO, -(off_t)ev->inlen, SEEK_CUR) >= 0){
+		ev->inlen = 0;
+		ev->eof = 0;
+	}
+	ev->nsyscalls++;
+}
+
+/* ev_line_ready - Is a whole line already buffered for read_line */
+int ev_line_ready(struct evloop *ev){
+	return memchr(ev->inbuf, '\n', ev->inlen) != NULL;
+}
+
+/* epoll_fill - ev_fill for the epoll backend: epoll_wait, then read */
+int epoll_fill(struct evloop *ev){
+	struct epoll_event evs[2];
+	uint64_t val;
+	int i, n, ready;
+
+	for(;;){
+		ready = ev->stdin_file;
+		if(!ready){
+			n = epoll_wait(ev->epfd, evs, 2, -1);
+			ev->nsyscalls++;
+			if(n < 0){
+				if(errno == EINTR){
+					continue;
+				}
+				return -1;
+			}
+			for(i = 0; i < n; i++){
+				if(evs[i].data.fd == ev->wakefd){
+					if(read(ev->wakefd, &val, sizeof(val)) > 0){}
+					ev->nsyscalls++;
+					tsh_events(ctx);
+					fflush(stdout);
+				}
+				else{
+					ready = 1;
+				}
+			}
+		}
+		if(ready){
+			n = read(STDIN_FILENO, ev->inbuf + ev->inlen, INBUFSIZE - ev->inlen);
+			ev->nsyscalls++;
+			if(n < 0 && (errno == EINTR || errno == EAGAIN)){
+				continue;
+			}
+			if(n > 0){
+				ev->inlen += n;
+			}
+			return n;
+		}
+	}
+}
+
+/* 
+* uring_fill - ev_fill for io_uring: keep a read of stdin and one of
+*    wakefd queued in the ring and let a single enter submit and wait.
+*
+* The stdin read is only ever in flight inside this function, so it
+* can't take input meant for a foreground job. Traps are the exception
+* (their commands may read stdin), so the read is cancelled first.
+*/
+int uring_fill(struct evloop *ev){
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned head;
+	int got = 0, woke, eof = 0;
+
+	for(;;){
+		if(!ev->reading){
+			sqe = uring_sqe(ev);
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = STDIN_FILENO;
+			sqe->addr = (unsigned long)(ev->inbuf + ev->inlen);
+			sqe->len = INBUFSIZE - ev->inlen;
+			sqe->off = -1;				/* current file position */
+			sqe->user_data = UD_STDIN;
+			ev->reading = 1;
+		}
+		if(!ev->waking && ev->wakefd >= 0){
+			sqe = uring_sqe(ev);
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = ev->wakefd;
+			sqe->addr = (unsigned long)&ev->wakeval;
+			sqe->len = sizeof(ev->wakeval);
+			sqe->off = -1;
+			sqe->user_data = UD_WAKE;
+			ev->waking = 1;
+		}
+		if(uring_enter(ev, 1) < 0){
+			return -1;
+		}
+
+		woke = 0;
+		head = *ev->cq_head;
+		while(head != __atomic_load_n(ev->cq_tail, __ATOMIC_ACQUIRE)){
+			cqe = &ev->cqes[head & *ev->cq_mask];
+			if(cqe->user_data == UD_STDIN){
+				ev->reading = 0;
+				if(cqe->res > 0){
+					ev->inlen += cqe->res;
+					got += cqe->res;
+				}
+				else if(cqe->res == 0){
+					eof = 1;
+				}
+				else if(cqe->res != -EINTR && cqe->res != -EAGAIN && cqe->res != -ECANCELED){
+					errno = -cqe->res;
+					got = -1;
+				}
+			}
+			else if(cqe->user_data == UD_WAKE){
+				ev->waking = 0;
+				woke = 1;
+			}
+			head++;
+		}
+		__atomic_store_n(ev->cq_head, head, __ATOMIC_RELEASE);
+
+		if(woke){
+			//a trap command may read stdin, so get our read out of the way first
+			while(ctx->ntrap_pending && ev->reading){
+				sqe = uring_sqe(ev);
+				memset(sqe, 0, sizeof(*sqe));
+				sqe->opcode = IORING_OP_ASYNC_CANCEL;
+				sqe->fd = -1;
+				sqe->addr = UD_STDIN;
+				sqe->user_data = UD_CANCEL;
+				if(uring_enter(ev, 1) < 0){
+					return -1;
+				}
+				head = *ev->cq_head;
+				while(head != __atomic_load_n(ev->cq_tail, __ATOMIC_ACQUIRE)){
+					cqe = &ev->cqes[head & *ev->cq_mask];
+					if(cqe->user_data == UD_STDIN){
+						ev->reading = 0;
+						if(cqe->res > 0){
+							ev->inlen += cqe->res;
+							got += cqe->res;
+						}
+						else if(cqe->res == 0){
+							eof = 1;
+						}
+					}
+					else if(cqe->user_data == UD_WAKE){
+						ev->waking = 0;
+					}
+					head++;
+				}
+				__atomic_store_n(ev->cq_head, head, __ATOMIC_RELEASE);
+			}
+			tsh_events(ctx);
+			fflush(stdout);
+		}
+		if(got || eof){
+			return got;
+		}
+	}
+}
 
 /* 
-* waitfg - Block until process pid is no longer the foreground process
+* uring_setup - Create a small ring and map its queues (no liburing)
 */
-void waitfg(pid_t pid){
-	/*don't call waitpid; use busyloop/sleep*/
-	
-	//pointer to current job
-	struct job_t* currentjob;
-	
-	//check jobs list getjobpid()
-	currentjob = getjobpid(jobs, pid);
+int uring_setup(struct evloop *ev){
+	struct io_uring_params p;
+	size_t sqlen, cqlen;
+	char *sq, *cq;
 
-	if(!currentjob){
-		return;
+	memset(&p, 0, sizeof(p));
+	if((ev->ringfd = fd_high(syscall(__NR_io_uring_setup, 8, &p))) < 0){
+		return -1;
+	}
+	sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP){
+		sqlen = cqlen = (sqlen > cqlen ? sqlen : cqlen);
+	}
+	sq = mmap(NULL, sqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ev->ringfd, IORING_OFF_SQ_RING);
+	if(sq == MAP_FAILED){
+		close(ev->ringfd);
+		return -1;
+	}
+	cq = sq;
+	if(!(p.features & IORING_FEAT_SINGLE_MMAP)){
+		cq = mmap(NULL, cqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ev->ringfd, IORING_OFF_CQ_RING);
 	}
+	ev->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_POPULATE, ev->ringfd, IORING_OFF_SQES);
+	if(cq == MAP_FAILED || ev->sqes == MAP_FAILED){
+		close(ev->ringfd);
+		return -1;
+	}
+	ev->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ev->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ev->sq_array = (unsigned *)(sq + p.sq_off.array);
+	ev->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ev->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ev->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ev->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+}
+
+/* uring_sqe - Claim the next submission slot, zeroed */
+struct io_uring_sqe *uring_sqe(struct evloop *ev){
+	unsigned tail = *ev->sq_tail;
+	unsigned idx = tail & *ev->sq_mask;
+	struct io_uring_sqe *sqe = &ev->sqes[idx];
 
-	//fgpid returns pid of current fg, or 0 if none
-	//so, if the pid we are waiting for is in the fg, the loop will run; else it will not equal 0
-	while((currentjob->state) == FG){
-		//do nothing, sleeps until false
-		sleep(1);
+	memset(sqe, 0, sizeof(*sqe));
+	ev->sq_array[idx] = idx;
+	__atomic_store_n(ev->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ev->nsubmit++;
+	return sqe;
+}
+
+/* uring_enter - Submit queued sqes and wait for at least wait completions */
+int uring_enter(struct evloop *ev, int wait){
+	int n;
+
+	for(;;){
+		n = syscall(__NR_io_uring_enter, ev->ringfd, ev->nsubmit, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+		ev->nsyscalls++;
+		if(n >= 0){
+			ev->nsubmit -= n;
+			return 0;
+		}
+		if(errno != EINTR){
+			return -1;
+		}
 	}
-	//sleep time over, continue
-	return;
 }
 
 /*****************
@@ -500,7 +6628,8 @@ void waitfg(pid_t pid){
  *     a child job terminates (becomes a zombie), or stops because it
  *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
  *     available zombie children, but doesn't wait for any other
- *     currently running children to terminate.  
+ *     currently running children to terminate. State changes are
+ *     queued for tsh_events() rather than printed here.
  */
 void sigchld_handler(int sig) {
 	/*cs:app page 727*/
@@ -509,31 +6638,132 @@ void sigchld_handler(int sig) {
 	
 	int status;
 	pid_t pid;
-	//waitpid reaps; 
+	int olderrno = errno;
+	int reaped = 0;
+	struct rusage ru;
+	//wait4 reaps, and hands back the child's rusage for the timing log
 
-	while((pid = waitpid(-1, &status, WUNTRACED|WNOHANG))>0){
-	
-		if(WIFEXITED(status)){
-			//kill job
-			deletejob(jobs, pid);
-		}
-		else if(WIFSIGNALED(status)){
-			//interrupted, so delete 
-			//feedback on action according to tshref	/*CSAPP 725: WTERMSIG returns number of signal that caused terminate
-			printf("Job [%d] (%d) terminated by signal %d\n", pid2jid(pid), pid, WTERMSIG(status));
-			deletejob(jobs, pid);
-		}
-		else if(WIFSTOPPED(status)){
-			//get the job with gjp
-			struct job_t * thisjob = getjobpid(jobs, pid);			
+	while((pid = wait4(-1, &status, WUNTRACED|WNOHANG, &ru))>0){
+		reaped += reap_child(pid, status, &ru);
+	}
+	//one CHLD trap per batch, however many jobs changed
+	if(reaped){
+		mark_trap(SIGCHLD);
+		//and one wakeup, so the prompt loop reports the batch right away
+		wake_main();
+	}
+	errno = olderrno;
+	return;
+}
+
+/* status_code - A wait status as a shell exit code, 128 + signal if killed */
+int status_code(int status){
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/* 
+* pipe_status - The wait status a finished job reports as its own
+*
+* The last stage's, or with pipefail the rightmost failed stage's (the
+* last stage's if none failed).
+*/
+int pipe_status(struct job_t *job){
+	int k;
+
+	for(k = job->nstages - 1; ctx->pipefail && k > 0; k--){
+		if(job->stage_status[k] != 0){
+			break;
+		}
+	}
+	return ctx->pipefail ? job->stage_status[k] : job->status;
+}
+
+/* 
+* reap_child - Apply one wait4 result to the job list
+*
+* Called from the SIGCHLD handler, or by code that reaps with SIGCHLD
+* blocked. Returns 1 for a change to a job not in the foreground (what
+* the CHLD trap counts), else 0; children we don't track are ignored.
+*/
+int reap_child(pid_t pid, int status, struct rusage *ru){
+	struct job_t *thisjob;
+	int stage;
+	int reaped = 0;
+	int rec[2];
+
+	//get the job any stage of it belongs to
+	thisjob = getjobstage(ctx->jobs, pid, &stage);
+	if(thisjob == NULL){
+		return 0;
+	}
+
+	if(WIFSTOPPED(status)){
+		//ctrl-z stops every stage; report the job once
+		if(thisjob->state != ST){
+			if(thisjob->state != FG){
+				reaped = 1;
+			}
 			//change state
 			thisjob->state = ST;
-			
-			//print message	
-			printf("Job [%d] (%d) stopped by signal %d\n", pid2jid(pid), pid, WSTOPSIG(status));
+			shm_publish(thisjob);
+			queue_event(thisjob, JOB_STOPPED, status);
 		}
+		return reaped;
 	}
-	return;
+
+	//a stage is done (a threaded run's stages all at once); the job goes when its last live process does
+	for( ; stage < thisjob->nstages && thisjob->pids[stage] == pid; stage++){
+		thisjob->pids[stage] = 0;
+		thisjob->stage_status[stage] = status;
+		//a threaded run that exited left each stage's own code
+		if(WIFEXITED(status) && thisjob->run_status && thisjob->run_status[stage] >= 0){
+			thisjob->stage_status[stage] = W_EXITCODE(thisjob->run_status[stage], 0);
+		}
+	}
+	if(stage == thisjob->nstages){
+		thisjob->status = status;
+	}
+	if(--thisjob->nlive > 0){
+		return 0;
+	}
+	status = pipe_status(thisjob);
+
+	//waitfg reads the foreground job's status once it's gone, pipestatus every stage's
+	if(thisjob->state == FG){
+		ctx->status = status;
+		memcpy(ctx->pipestatus, thisjob->stage_status, thisjob->nstages * sizeof(int));
+		ctx->npipestatus = thisjob->nstages;
+	}
+	//only background changes count for CHLD (a trap's own commands run in the foreground)
+	else{
+		reaped = 1;
+	}
+
+	//rusage is the stage reaped last's (for a plain command, the command's)
+	log_timing(thisjob, status, ru);
+	//a finished @dedup leader takes no more requests
+	dedup_done(thisjob->pid, status);
+	rec[0] = thisjob->pid;
+	rec[1] = status;
+	rec_event(REC_EXIT, rec, sizeof(rec));
+	//group totals outlive the members
+	if(thisjob->group >= 0){
+		groups[thisjob->group].ndone++;
+		groups[thisjob->group].nfailed += !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+
+	if(WIFEXITED(status)){
+		//kill job
+		queue_event(thisjob, JOB_EXITED, status);
+	}
+	else{
+		//interrupted, so delete 
+		//feedback is printed later by tsh_events	/*CSAPP 725: WTERMSIG returns number of signal that caused terminate
+		queue_event(thisjob, JOB_SIGNALED, status);
+	}
+	deletejob(ctx->jobs, thisjob->pid);
+	ctx->ndone++;
+	return reaped;
 }
 
 /* 
@@ -545,16 +6775,13 @@ void sigint_handler(int sig) {
 	
 	/*need to distinguish that the fg job is what should be handled*/
 	
-	pid_t pid;
-	//current fg pid can be obtained with fgpid() built in
-	pid = fgpid(jobs);
-	//if no fg job, no effect
-	if(getjobpid(jobs, pid) == NULL){
-		return;
+	//an INT trap runs later from the main loop; forwarding still happens
+	mark_trap(sig);
+	rec_event(REC_SIGNAL, &sig, sizeof(sig));
+	//if no fg job, no effect (other than stopping a drain or wait)
+	if(kill_fg(sig) == 0){
+		interrupted = 1;
 	}
-
-	//kill passes along to chld handler (-pid for group)
-	kill(-pid, sig);
 	return;
 }
 
@@ -566,23 +6793,494 @@ void sigint_handler(int sig) {
 void sigtstp_handler(int sig){
 	/*need to distinguish that the fg job is what should be handled*/
 	
-	pid_t pid;
-	//current fg pid can be obtained with fgpid() built in
-	pid = fgpid(jobs);
+	mark_trap(sig);
+	rec_event(REC_SIGNAL, &sig, sizeof(sig));
 	//if no fg job, no effect
-	if(getjobpid(jobs, pid) == NULL){
-		return;
-	}
-	
-	//kill passes along to chld handler (-pid for group)
-	kill(-pid, sig);
+	kill_fg(sig);
 	return;
 }
 
+/* 
+* kill_fg - Pass sig on to the foreground job's process group (every
+*    member's, after fg @group); returns how many were signalled
+*/
+int kill_fg(int sig){
+	int i, n = 0;
+
+	for(i = 0; i < MAXJOBS; i++){
+		if(ctx->jobs[i].state == FG){
+			//kill passes along to chld handler (-pid for group)
+			kill(-ctx->jobs[i].pid, sig);
+			n++;
+		}
+	}
+	return n;
+}
+
+/*
+* trap_handler - Handler for signals that only have a trap (USR1, TERM, ...)
+*/
+void trap_handler(int sig){
+	mark_trap(sig);
+}
+
+/*
+* mark_trap - Flag sig's trap to run at the next safe point, if it has one.
+*    Only sets flags, so it is safe in signal context.
+*/
+void mark_trap(int sig){
+	if(ctx->traps[sig]){
+		ctx->trap_pending[sig] = 1;
+		ctx->ntrap_pending = 1;
+		wake_main();
+	}
+}
+
+/*
+* wake_main - Bump the context's wakefd so a waiting read loop runs
+*    tsh_events(). write() is async-signal-safe; a full counter is fine.
+*/
+void wake_main(void){
+	uint64_t one = 1;
+	int olderrno = errno;
+	ssize_t n;
+
+	if(ctx->wakefd >= 0){
+		n = write(ctx->wakefd, &one, sizeof(one));
+		(void)n;
+	}
+	errno = olderrno;
+}
+
 /*********************
  * End signal handlers
  *********************/
 
+/* 
+* shm_setup - Create this shell's /tsh-PID job table segment (tsh -m reads it)
+*
+* Best effort: without one the shell just doesn't publish. Run again
+* after reexec, the same pid gets the same segment back, emptied. Only
+* its owner can read it (command lines can carry secrets); a segment by
+* that name someone else made is left alone. Every exit() removes it,
+* the error and SIGQUIT paths included; an exec (reexec) keeps it.
+*/
+void shm_setup(void){
+	struct stat st;
+	char name[32];
+	int fd, i;
+
+	snprintf(name, sizeof(name), SHM_NAME "%d", (int)getpid());
+	if((fd = shm_open(name, O_RDWR|O_CREAT|O_CLOEXEC, 0600)) < 0){
+		return;
+	}
+	if(fstat(fd, &st) < 0 || st.st_uid != getuid() || fchmod(fd, 0600) < 0){
+		close(fd);
+		return;
+	}
+	if(ftruncate(fd, sizeof(struct tsh_shm)) == 0){
+		shm_tab = mmap(NULL, sizeof(struct tsh_shm), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		if(shm_tab == MAP_FAILED){
+			shm_tab = NULL;
+		}
+	}
+	close(fd);
+	if(shm_tab == NULL){
+		shm_unlink(name);
+		return;
+	}
+	shm_tab->magic = TSH_SHM_MAGIC;
+	shm_tab->shell = getpid();
+	for(i = 0; i < MAXJOBS; i++){
+		shm_publish(&ctx->jobs[i]);
+	}
+	atexit(shm_cleanup);
+}
+
+/* shm_cleanup - atexit hook: unlink the job table segment, if it is this process's own */
+void shm_cleanup(void){
+	char name[32];
+
+	//a forked child that calls exit() must leave its shell's segment be
+	if(shm_tab == NULL || shm_tab->shell != getpid()){
+		return;
+	}
+	snprintf(name, sizeof(name), SHM_NAME "%d", (int)getpid());
+	shm_unlink(name);
+}
+
+/* 
+* shm_publish - Copy one job's slot into the shared table
+*
+* Called wherever a job is added, deleted or changes state, in signal
+* context too, so signals are blocked while seq is odd: a handler's
+* update landing inside ours would let a reader through mid-write.
+*/
+void shm_publish(struct job_t *job){
+	struct tsh_shm_job *sj;
+	struct timespec ts;
+	sigset_t all, prev;
+	clockid_t clk;
+	unsigned seq;
+	int i;
+
+	if(shm_tab == NULL || job < ctx->jobs || job >= ctx->jobs + MAXJOBS){
+		return;
+	}
+	sj = &shm_tab->jobs[job - ctx->jobs];
+	sigfillset(&all);
+	sigprocmask(SIG_BLOCK, &all, &prev);
+	seq = shm_tab->seq;
+	__atomic_store_n(&shm_tab->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	sj->pid = job->pid;
+	sj->jid = job->jid;
+	sj->state = job->state;
+	sj->nstages = job->nstages;
+	sj->start = job->start;
+	//cpu so far of the stages still running (the shell's own children only)
+	sj->cpu_ns = 0;
+	for(i = 0; i < job->nstages && job->pidfd < 0; i++){
+		//(a threaded run's stages are one process, counted once)
+		if(i > 0 && job->pids[i] == job->pids[i - 1]){
+			continue;
+		}
+		if(job->pids[i] > 0 && clock_getcpuclockid(job->pids[i], &clk) == 0 && clock_gettime(clk, &ts) == 0){
+			sj->cpu_ns += ts.tv_sec * 1000000000LL + ts.tv_nsec;
+		}
+	}
+	i = strnlen(job->cmdline, SHMCMDLEN - 1);
+	memcpy(sj->cmdline, job->cmdline, i);
+	sj->cmdline[i] = '\0';
+
+	__atomic_store_n(&shm_tab->seq, seq + 2, __ATOMIC_RELEASE);
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/* 
+* shm_monitor - tsh -m PID: print the job table shell PID publishes
+*
+* Takes a seqlock snapshot: copy, then retry if a write was under way or
+* finished meanwhile. Only the open and mmap are syscalls.
+*/
+int shm_monitor(const char *pid){
+	struct tsh_shm *tab, snap;
+	struct tsh_shm_job *sj;
+	struct timespec now;
+	char name[32];
+	unsigned seq;
+	int fd, i, tries;
+
+	snprintf(name, sizeof(name), SHM_NAME "%s", pid);
+	if((fd = shm_open(name, O_RDONLY, 0)) < 0){
+		printf("%s: %s\n", name, strerror(errno));
+		return 1;
+	}
+	tab = mmap(NULL, sizeof(*tab), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(tab == MAP_FAILED){
+		printf("%s: %s\n", name, strerror(errno));
+		return 1;
+	}
+	for(tries = 0; ; tries++){
+		if(tries == 1000){
+			printf("%s: no consistent snapshot (shell stuck mid-update?)\n", name);
+			return 1;
+		}
+		seq = __atomic_load_n(&tab->seq, __ATOMIC_ACQUIRE);
+		if(seq & 1){
+			sched_yield();
+			continue;
+		}
+		memcpy(&snap, tab, sizeof(snap));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&tab->seq, __ATOMIC_RELAXED) == seq){
+			break;
+		}
+	}
+	if(snap.magic != TSH_SHM_MAGIC){
+		printf("%s: not a tsh job table\n", name);
+		return 1;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	printf("%-4s %-8s %-10s %9s %9s  %s\n", "JID", "PID", "STATE", "ELAPSED", "CPU", "COMMAND");
+	for(i = 0; i < MAXJOBS; i++){
+		sj = &snap.jobs[i];
+		if(sj->pid == 0){
+			continue;
+		}
+		printf("%-4d %-8d %-10s %8.1fs %8.2fs  %s%s",
+			sj->jid, (int)sj->pid,
+			sj->state == FG ? "Foreground" : sj->state == BG ? "Running" : sj->state == ST ? "Stopped" : "?",
+			(now.tv_sec - sj->start.tv_sec) + (now.tv_nsec - sj->start.tv_nsec) / 1e9,
+			sj->cpu_ns / 1e9, sj->cmdline,
+			strchr(sj->cmdline, '\n') ? "" : "...\n");
+	}
+	return 0;
+}
+
+/* 
+* rec_open - Start recording this session to path (tsh -r)
+*/
+void rec_open(const char *path){
+	if((recfd = fd_high(open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600))) < 0 ||
+	   write(recfd, REC_MAGIC, sizeof(REC_MAGIC) - 1) != sizeof(REC_MAGIC) - 1){
+		printf("%s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &rec_t0);
+}
+
+/* 
+* rec_event - Append one record to the session recording, if any
+*
+* One write per record, so it is safe from the signal handlers too and
+* their records never land inside another. Under -R the recording is a
+* pipe, where only writes of up to PIPE_BUF are atomic, so longer input
+* goes as several records of at most that size, all with one time.
+*/
+void rec_event(int type, const void *data, int len){
+	char buf[PIPE_BUF];
+	struct rec_hdr *h = (struct rec_hdr *)buf;
+	struct timespec now;
+	int olderrno = errno;
+	int chunk, off;
+	ssize_t n;
+
+	if(recfd < 0){
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	h->t_us = (now.tv_sec - rec_t0.tv_sec) * 1000000 + (now.tv_nsec - rec_t0.tv_nsec) / 1000;
+	h->type = type;
+	//do-while: a 0-byte REC_INPUT (end of input) is a record too
+	do{
+		chunk = (len < (int)(sizeof(buf) - sizeof(*h))) ? len : (int)(sizeof(buf) - sizeof(*h));
+		h->len = chunk;
+		memcpy(buf + sizeof(*h), data, chunk);
+		//a short write only happens on a file (disk full): finish the record rather than leave half of it
+		for(off = 0; off < (int)sizeof(*h) + chunk; off += n){
+			if((n = write(recfd, buf + off, sizeof(*h) + chunk - off)) < 0){
+				if(errno == EINTR){
+					n = 0;
+					continue;
+				}
+				errno = olderrno;
+				return;
+			}
+		}
+		data = (const char *)data + chunk;
+		len -= chunk;
+	}while(len > 0);
+	errno = olderrno;
+}
+
+/* now_us - CLOCK_MONOTONIC in microseconds */
+long long now_us(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* 
+* replay - tsh -R FILE: play a recorded session into a fresh shell and
+*    report its latencies
+*
+* The shell runs on a pty, recording itself into a pipe back to us, so
+* its prompts tell us when it is ready. Each input (and each recorded
+* ctrl-c or ctrl-z, sent as the signal) goes in after the same pause
+* the user took after the event before it, counted from when the
+* replayed shell got to that point rather than from the wall clock; so
+* a replay keeps the session's order however fast or slow the shell
+* is. Measures prompt return (a line sent to the next prompt) and echo
+* (bytes sent to the pty echoing them back).
+*/
+int replay(const char *path){
+	struct replay rp;
+	struct rec_hdr *h;
+	struct stat st;
+	char *file, *p, *end;
+	int fd, pfd[2], sig, nprompts = 0, ninputs = 0, nsignals = 0, status;
+	long long t_anchor = 0, s_anchor, t0;
+	pid_t pid;
+
+	if((fd = open(path, O_RDONLY|O_CLOEXEC)) < 0 || fstat(fd, &st) < 0 ||
+	   (file = mmap(NULL, st.st_size + 1, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED){
+		printf("%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	close(fd);
+	end = file + st.st_size;
+	if(st.st_size < (off_t)sizeof(REC_MAGIC) - 1 || memcmp(file, REC_MAGIC, sizeof(REC_MAGIC) - 1)){
+		printf("%s: not a tsh session recording\n", path);
+		return 1;
+	}
+
+	memset(&rp, 0, sizeof(rp));
+	rp.line_sent = rp.echo_sent = -1;
+	rp.magic = sizeof(REC_MAGIC) - 1;
+	//at most a prompt per input byte, plus the first
+	rp.arrive = malloc((st.st_size + 1) * sizeof(long long));
+	rp.plat = malloc(st.st_size * sizeof(long long));
+	rp.elat = malloc(st.st_size * sizeof(long long));
+	if((rp.master = posix_openpt(O_RDWR|O_NOCTTY|O_CLOEXEC)) < 0 || grantpt(rp.master) < 0 ||
+	   unlockpt(rp.master) < 0 || pipe2(pfd, O_CLOEXEC) < 0 || !rp.arrive || !rp.plat || !rp.elat){
+		printf("replay: %s\n", strerror(errno));
+		return 1;
+	}
+	if((pid = fork()) == 0){
+		//the pty becomes the new session's terminal, as a login's would
+		setsid();
+		if((fd = open(ptsname(rp.master), O_RDWR)) < 0){
+			_exit(127);
+		}
+		dup2(fd, 0);
+		dup2(fd, 1);
+		dup2(fd, 2);
+		dup2(pfd[1], 3);
+		execl("/proc/self/exe", shell_argv[0], "-r", "/dev/fd/3", (char *)NULL);
+		_exit(127);
+	}
+	close(pfd[1]);
+	rp.recfd = pfd[0];
+	rp.child = pid;
+	t0 = s_anchor = now_us();
+
+	for(p = file + sizeof(REC_MAGIC) - 1; p + sizeof(*h) <= end; p += sizeof(*h) + h->len){
+		h = (struct rec_hdr *)p;
+		if(p + sizeof(*h) + h->len > end){
+			break;
+		}
+		if(h->type == REC_PROMPT){
+			//the replayed shell gets there first; the pause after it runs from then
+			nprompts++;
+			replay_pump(&rp, nprompts, now_us() + REPLAY_WAIT);
+			t_anchor = h->t_us;
+			s_anchor = (rp.nprompts >= nprompts) ? rp.arrive[nprompts - 1] : now_us();
+			continue;
+		}
+		if(h->type != REC_INPUT && h->type != REC_SIGNAL){
+			continue;
+		}
+		//(uint32_t) keeps deltas right across the 71 minute wrap of t_us
+		replay_pump(&rp, INT_MAX, s_anchor + (uint32_t)(h->t_us - t_anchor));
+		t_anchor = h->t_us;
+		s_anchor = now_us();
+		if(h->type == REC_SIGNAL){
+			memcpy(&sig, p + sizeof(*h), sizeof(sig));
+			kill(rp.child, sig);
+			nsignals++;
+			continue;
+		}
+		ninputs++;
+		//the end of input is a ctrl-d to the terminal
+		if(h->len == 0){
+			if(write(rp.master, "\004", 1) < 0){
+				break;
+			}
+			continue;
+		}
+		if(write(rp.master, p + sizeof(*h), h->len) < 0){
+			break;
+		}
+		rp.echo_sent = s_anchor;
+		rp.echo_ch = p[sizeof(*h)];
+		if(memchr(p + sizeof(*h), '\n', h->len)){
+			rp.line_sent = s_anchor;
+		}
+	}
+
+	//let the shell finish what it was given, then make sure it is gone
+	replay_pump(&rp, INT_MAX, now_us() + REPLAY_WAIT);
+	kill(rp.child, SIGKILL);
+	waitpid(rp.child, &status, 0);
+
+	printf("replay: %d inputs, %d signals, %d prompts in %.3fs\n", ninputs, nsignals, rp.nprompts, (now_us() - t0) / 1e6);
+	replay_stats("prompt return", rp.plat, rp.nplat);
+	replay_stats("echo", rp.elat, rp.nelat);
+	munmap(file, st.st_size + 1);
+	free(rp.arrive);
+	free(rp.plat);
+	free(rp.elat);
+	return 0;
+}
+
+/* 
+* replay_pump - Take in the replayed shell's output and records until it
+*    has shown nprompts prompts, deadline (in now_us time) passes, or it
+*    is gone; notes latencies as prompts and echoes arrive
+*/
+void replay_pump(struct replay *rp, int nprompts, long long deadline){
+	struct pollfd pfd[2];
+	struct rec_hdr *h;
+	char buf[INBUFSIZE];
+	long long now;
+	int n, off;
+
+	while(rp->nprompts < nprompts && !rp->gone && (now = now_us()) < deadline){
+		pfd[0].fd = rp->master;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = rp->recfd;
+		pfd[1].events = POLLIN;
+		if(poll(pfd, 2, (deadline - now + 999) / 1000) <= 0){
+			continue;
+		}
+		now = now_us();
+		if(pfd[0].revents){
+			//EIO once the shell has closed the pty
+			if((n = read(rp->master, buf, sizeof(buf))) <= 0){
+				rp->gone = 1;
+			}
+			else if(rp->echo_sent >= 0 && memchr(buf, rp->echo_ch, n)){
+				rp->elat[rp->nelat++] = now - rp->echo_sent;
+				rp->echo_sent = -1;
+			}
+		}
+		if(pfd[1].revents){
+			if((n = read(rp->recfd, rp->rbuf + rp->rlen, sizeof(rp->rbuf) - rp->rlen)) <= 0){
+				rp->gone = 1;
+				continue;
+			}
+			rp->rlen += n;
+			//the recording starts with its magic, not a record
+			n = (rp->magic < rp->rlen) ? rp->magic : rp->rlen;
+			memmove(rp->rbuf, rp->rbuf + n, rp->rlen - n);
+			rp->rlen -= n;
+			rp->magic -= n;
+			for(off = 0; off + (int)sizeof(*h) <= rp->rlen; off += sizeof(*h) + h->len){
+				h = (struct rec_hdr *)(rp->rbuf + off);
+				if(off + (int)sizeof(*h) + h->len > rp->rlen){
+					break;
+				}
+				if(h->type != REC_PROMPT){
+					continue;
+				}
+				rp->arrive[rp->nprompts++] = now;
+				if(rp->line_sent >= 0){
+					rp->plat[rp->nplat++] = now - rp->line_sent;
+					rp->line_sent = -1;
+				}
+			}
+			memmove(rp->rbuf, rp->rbuf + off, rp->rlen - off);
+			rp->rlen -= off;
+		}
+	}
+}
+
+/* replay_stats - Print count, p50, p95 and max of n latencies (us) */
+void replay_stats(const char *what, long long *lat, int n){
+	if(n == 0){
+		printf("%s: no samples\n", what);
+		return;
+	}
+	qsort(lat, n, sizeof(*lat), cmp_ll);
+	printf("%s: n=%d p50 %.3fms p95 %.3fms max %.3fms\n", what, n,
+		pct_rank(lat, n, 50) / 1e3, pct_rank(lat, n, 95) / 1e3, lat[n - 1] / 1e3);
+}
+
 /***********************************************
  * Helper routines that manipulate the job list
  **********************************************/
@@ -590,9 +7288,20 @@ void sigtstp_handler(int sig){
 /* clearjob - Clear the entries in a job struct */
 void clearjob(struct job_t *job) {
 	job->pid = 0;
+	job->pidfd = -1;
 	job->jid = 0;
 	job->state = UNDEF;
 	job->cmdline[0] = '\0';
+	job->nstages = 0;
+	job->nlive = 0;
+	job->status = 0;
+	memset(job->stage_status, 0, sizeof(job->stage_status));
+	if(job->run_status){
+		munmap(job->run_status, MAXSTAGES * sizeof(int));
+		job->run_status = NULL;
+	}
+	job->readahead = 0;
+	job->group = job->gprev = job->gnext = -1;
 }
 
 /* initjobs - Initialize the job list */
@@ -615,7 +7324,7 @@ int maxjid(struct job_t *jobs)
 }
 
 /* addjob - Add a job to the job list */
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) 
+int addjob(struct job_t *jobs, pid_t pid, int state, const char *cmdline) 
 {
 	int i;
 	
@@ -625,14 +7334,20 @@ int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline)
 	for (i = 0; i < MAXJOBS; i++) {
 		if (jobs[i].pid == 0) {
 			jobs[i].pid = pid;
+			jobs[i].pids[0] = pid;
+			jobs[i].nstages = 1;
+			jobs[i].nlive = 1;
 			jobs[i].state = state;
-			jobs[i].jid = nextjid++;
-			if (nextjid > MAXJOBS)
-				nextjid = 1;
+			clock_gettime(CLOCK_REALTIME, &jobs[i].start);
+			clock_gettime(CLOCK_MONOTONIC, &jobs[i].start_mono);
+			jobs[i].jid = ctx->nextjid++;
+			if (ctx->nextjid > MAXJOBS)
+				ctx->nextjid = 1;
 			strcpy(jobs[i].cmdline, cmdline);
-			if(verbose){
+			if(ctx->verbose){
 				printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
 			}
+			shm_publish(&jobs[i]);
 			return 1;
 		}
 	}
@@ -649,8 +7364,10 @@ int deletejob(struct job_t *jobs, pid_t pid) {
 
 	for (i = 0; i < MAXJOBS; i++) {
 		if (jobs[i].pid == pid) {
+			group_leave(&jobs[i]);
 			clearjob(&jobs[i]);
-			nextjid = maxjid(jobs)+1;
+			ctx->nextjid = maxjid(jobs)+1;
+			shm_publish(&jobs[i]);
 			return 1;
 		}
 	}
@@ -679,6 +7396,21 @@ struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
 	return NULL;
 }
 
+/* getjobstage - Find the job with a stage whose PID=pid, and which stage it is */
+struct job_t *getjobstage(struct job_t *jobs, pid_t pid, int *stage) {
+	int i, k;
+
+	if (pid < 1)
+		return NULL;
+	for (i = 0; i < MAXJOBS; i++)
+		for (k = 0; k < jobs[i].nstages; k++)
+			if (jobs[i].pids[k] == pid) {
+				*stage = k;
+				return &jobs[i];
+			}
+	return NULL;
+}
+
 /* getjobjid  - Find a job (by JID) on the job list */
 struct job_t *getjobjid(struct job_t *jobs, int jid) {
 	int i;
@@ -698,15 +7430,15 @@ int pid2jid(pid_t pid) {
 	if (pid < 1)
 		return 0;
 	for (i = 0; i < MAXJOBS; i++)
-		if (jobs[i].pid == pid) {
-			return jobs[i].jid;
+		if (ctx->jobs[i].pid == pid) {
+			return ctx->jobs[i].jid;
 		}
 	return 0;
 }
 
 /* listjobs - Print the job list */
 void listjobs(struct job_t *jobs) {
-	int i;
+	int i, k;
 	
 	for (i = 0; i < MAXJOBS; i++) {
 	if (jobs[i].pid != 0) {
@@ -726,9 +7458,42 @@ void listjobs(struct job_t *jobs) {
 			i, jobs[i].state);
 		}
 		printf("%s", jobs[i].cmdline);
+		//a pipeline still running can already have a stage that failed
+		for(k = 0; k < jobs[i].nstages; k++){
+			if(jobs[i].pids[k] == 0 && jobs[i].stage_status[k] != 0){
+				printf("    stage %d of %d failed with status %d\n", k + 1, jobs[i].nstages,
+					status_code(jobs[i].stage_status[k]));
+				break;
+			}
+		}
 	}
+	}
+}
+/* queue_event - Record a job state change for tsh_events (signal context) */
+void queue_event(struct job_t *job, int event, int status) {
+	struct job_event *ev;
+
+	//a full queue drops the newest events rather than blocking the handler
+	if (ctx->nevents >= MAXEVENTS)
+		return;
+	ev = &ctx->events[ctx->nevents];
+	ev->pid = job->pid;
+	ev->jid = job->jid;
+	ev->event = event;
+	ev->status = status;
+	ctx->nevents++;
+}
 
+/* report_event - Print the message tsh shows for a job event */
+void report_event(struct job_event *ev) {
+	if (ev->event == JOB_SIGNALED)
+		printf("Job [%d] (%d) terminated by signal %d\n", ev->jid, ev->pid, WTERMSIG(ev->status));
+	else if (ev->event == JOB_STOPPED)
+		printf("Job [%d] (%d) stopped by signal %d\n", ev->jid, ev->pid, WSTOPSIG(ev->status));
+	else if (ev->event == JOB_DONE)
+		printf("Job [%d] (%d) done\n", ev->jid, ev->pid);
 }
+
 /******************************
  * end job list helper routines
  ******************************/
@@ -743,10 +7508,15 @@ void listjobs(struct job_t *jobs) {
  */
 void usage(void) 
 {
-	printf("Usage: shell [-hvp]\n");
+	printf("Usage: shell [-hvp] [-c command] [-e backend] [-m pid] [-r file | -R file]\n");
 	printf("   -h   print this message\n");
 	printf("   -v   print additional diagnostic information\n");
 	printf("   -p   do not emit a command prompt\n");
+	printf("   -c   run command and exit (skips the rc file)\n");
+	printf("   -e   input event loop: epoll (default) or io_uring\n");
+	printf("   -m   print the job table shell pid publishes, and exit\n");
+	printf("   -r   record the session (input, signals, job exits) to file\n");
+	printf("   -R   replay a recorded session into a new shell and report its latencies\n");
 	exit(1);
 }
 
@@ -790,6 +7560,44 @@ handler_t *Signal(int signum, handler_t *handler)
  */
 void sigquit_handler(int sig) 
 {
+	//a QUIT trap replaces the default of terminating
+	if (ctx->traps[SIGQUIT]) {
+		mark_trap(sig);
+		return;
+	}
 	printf("Terminating after receipt of SIGQUIT signal\n");
 	exit(1);
-}
\ No newline at end of file
+}
+
+#ifdef TSH_FUZZ
+/*
+ * tsh_fuzz_parse - Put one line through every parse eval does before it
+ *    forks: parseline, parse_launch_opts, split_pipeline, then env_words
+ *    and parse_redir over each stage. Nothing is run. The entry point
+ *    for fuzz/fuzz_parse.c; returns the number of stages, 0 if rejected.
+ */
+int tsh_fuzz_parse(const char *cmdline)
+{
+	char buf[MAXLINE];
+	char *argv[MAXARGS];
+	char **stages[MAXSTAGES];
+	struct launch_opts opts;
+	struct redir rd;
+	int i, k, n, nstages;
+
+	parseline(cmdline, buf, argv);
+	if (argv[0] == NULL || parse_launch_opts(argv, &opts) < 0 || argv[0] == NULL)
+		return 0;
+	if ((nstages = split_pipeline(argv, stages)) < 0)
+		return 0;
+	for (k = 0; k < nstages; k++) {
+		env_words(stages[k]);
+		for (i = 0; stages[k][i]; i += n) {
+			//a missing target (-1) is skipped like a plain word
+			if ((n = parse_redir(stages[k], i, &rd)) <= 0)
+				n = 1;
+		}
+	}
+	return nstages;
+}
+#endif /* TSH_FUZZ */
@@ -0,0 +1,176 @@
+/*
+ * tsh.h - Embedding interface for the tiny shell
+ *
+ * tinyShell.c built with -DTSH_LIBRARY leaves out main() and can be
+ * linked into another program, which drives the shell through a
+ * tsh_ctx instead of writing to a tsh process's stdin:
+ *
+ *     struct tsh_ctx sh;
+ *     struct tsh_result res;
+ *     tsh_init(&sh);
+ *     sh.on_job = my_callback;
+ *     tsh_eval(&sh, "/bin/ls -l\n", &res);
+ *
+ * tsh_init() installs the shell's signal handlers, and those act on the
+ * most recently initialised context, so only one context can run jobs
+ * at a time.
+ */
+#ifndef TSH_H
+#define TSH_H
+
+#include <signal.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* Misc manifest constants */
+#define TSH_MAXLINE    1024		/* max line size */
+#define TSH_MAXARGS     128		/* max args on a command line */
+#define TSH_MAXJOBS      16		/* max jobs at any point in time */
+#define TSH_MAXJID  (1<<16)		/* max job ID */
+#define TSH_MAXEVENTS    64		/* job events queued between drains */
+#define TSH_MAXSTAGES     8		/* max commands in one pipeline */
+
+/* Pseudo-signals for the trap builtin (real signals are 1..NSIG-1) */
+#define TRAP_EXIT 0			/* shell exit */
+#define TRAP_ERR  NSIG		/* foreground command failed */
+
+/* Job states */
+#define TSH_UNDEF 0		/* undefined */
+#define TSH_FG 1		/* running in foreground */
+#define TSH_BG 2		/* running in background */
+#define TSH_ST 3		/* stopped */
+
+/* Job events, see tsh_ctx.on_job */
+#define JOB_EXITED   1	/* exited normally, status holds the wait status */
+#define JOB_SIGNALED 2	/* terminated by a signal */
+#define JOB_STOPPED  3	/* stopped by a signal */
+#define JOB_DONE     4	/* an attached job (not our child) ended; status is unknown, 0 */
+
+/* The job struct; a pipeline is one job, its stages sharing a process group */
+struct job_t {
+    pid_t pid;				/* job PID (first stage, and the process group) */
+    int jid;				/* job ID [1, 2, ...] */
+    int state;				/* TSH_UNDEF, TSH_BG, TSH_FG, or TSH_ST */
+    char cmdline[TSH_MAXLINE];	/* command line */
+    int pidfd;				/* attached (not our child) jobs: pidfd to watch, else -1 */
+    struct timespec start;	/* wall clock launch time */
+    struct timespec start_mono;	/* CLOCK_MONOTONIC launch time, for durations */
+    pid_t pids[TSH_MAXSTAGES];	/* each stage's PID, 0 once reaped */
+    int nstages;			/* stages in the pipeline (1 for a plain command) */
+    int nlive;				/* processes not reaped yet (a threaded run of
+							   stages is one, its pid in each of their
+							   pids[]); the job ends at 0 */
+    int status;				/* wait status of the last stage */
+    int stage_status[TSH_MAXSTAGES];	/* each stage's wait status, once reaped */
+    int *run_status;		/* per-stage exit codes a threaded run's child
+							   leaves in shared memory (-1 until set),
+							   NULL if the job has no threaded run */
+    int readahead;			/* its stdin isn't the shell's, so the shell may read
+							   ahead while it runs in the foreground */
+    int group;				/* its job group's index, -1 for none */
+    int gprev, gnext;		/* the group's neighbouring members' slots, -1 at the ends */
+};
+
+/* One job state change, as recorded by the SIGCHLD handler */
+struct job_event {
+	pid_t pid;				/* job PID */
+	int jid;				/* job ID at the time of the event */
+	int event;				/* JOB_EXITED, JOB_SIGNALED, JOB_STOPPED or JOB_DONE */
+	int status;				/* raw wait status */
+};
+
+typedef void job_callback_t(struct job_event *ev, void *udata);
+
+/* The shell context: all state eval() and the job helpers work on */
+struct tsh_ctx {
+	struct job_t jobs[TSH_MAXJOBS];	/* the job list */
+	int nextjid;				/* next job ID to allocate */
+	int verbose;				/* if true, print additional output */
+	int status;					/* wait status of the last foreground job */
+	int pipefail;				/* set -o pipefail: a pipeline's status is its
+								   rightmost failed stage's, not its last's */
+	int nothreads;				/* set +o pipethreads: every pipeline stage gets its
+								   own process, even adjacent stream builtins */
+	int pipestatus[TSH_MAXSTAGES];	/* the last foreground job's per-stage wait statuses */
+	int npipestatus;			/* its stage count, 0 before the first */
+
+	/* events are queued by the SIGCHLD handler and handed to on_job
+	   from tsh_events(), never from signal context */
+	struct job_event events[TSH_MAXEVENTS];
+	volatile sig_atomic_t nevents;
+	job_callback_t *on_job;		/* NULL: print tsh's usual messages */
+	void *udata;				/* passed through to on_job */
+	int wakefd;					/* eventfd bumped when there is something
+								   for tsh_events(), -1 for none */
+	unsigned long ndone;		/* jobs reaped so far */
+	int stdin_moved;			/* exec redirected fd 0; buffered input is stale */
+	int timingfd;				/* timing log ($TSH_TIMINGS), -1 not yet opened, -2 off */
+
+	/* trap commands; handlers only set trap_pending, the commands run
+	   from tsh_events() at the next safe point */
+	char *traps[NSIG + 1];		/* command per signal/TRAP_*, NULL if none */
+	volatile sig_atomic_t trap_pending[NSIG + 1];
+	volatile sig_atomic_t ntrap_pending;	/* any trap_pending set */
+};
+
+/* What tsh_eval() did with one command line */
+struct tsh_result {
+	int builtin;			/* 1 if the line was a builtin (or blank) */
+	pid_t pid;				/* PID of the job started, 0 if none */
+	int jid;				/* its job ID */
+	int state;				/* TSH_BG if backgrounded, TSH_ST if it stopped, TSH_UNDEF once done */
+	int status;				/* wait status of a finished foreground job */
+};
+
+/*
+ * The job table a shell publishes in the shared memory segment /tsh-PID
+ * (tsh -m PID prints it). seq is a seqlock: it is odd while the shell
+ * writes, so a reader copies the table and retries if seq was odd or
+ * changed meanwhile. The shell never waits for readers.
+ */
+#define TSH_SHM_MAGIC 0x31687374	/* "tsh1" */
+#define TSH_SHMCMDLEN 64		/* cmdline bytes kept per job */
+
+struct tsh_shm_job {
+	pid_t pid;				/* job PID, 0 for an empty slot */
+	int jid;				/* job ID */
+	int state;				/* TSH_FG, TSH_BG or TSH_ST */
+	int nstages;			/* stages in the pipeline */
+	struct timespec start;	/* wall clock launch time */
+	long long cpu_ns;		/* CPU time of its live stages at its last update */
+	char cmdline[TSH_SHMCMDLEN];	/* command line, truncated */
+};
+
+struct tsh_shm {
+	unsigned magic;			/* TSH_SHM_MAGIC */
+	pid_t shell;			/* the publishing shell */
+	unsigned seq;			/* seqlock sequence, odd mid-update */
+	struct tsh_shm_job jobs[TSH_MAXJOBS];	/* same slots as the job list */
+};
+
+/*
+ * Loadable builtins: after "enable -f plugin.so name", running name calls
+ *
+ *     int tsh_builtin_name(int argc, char **argv, const struct tsh_builtin_api *api);
+ *
+ * in the shell's own process; its return value is the exit status. The
+ * object must also define "int tsh_plugin_abi = TSH_PLUGIN_ABI;". A
+ * builtin does its I/O on api->in/out/err (its redirections are applied
+ * to those, not to the shell), and must not exit or keep argv.
+ */
+#define TSH_PLUGIN_ABI 1
+
+struct tsh_builtin_api {
+	int abi;				/* TSH_PLUGIN_ABI */
+	int in, out, err;		/* the builtin's stdin, stdout and stderr */
+	char *(*getenv)(const char *name);
+	int (*setenv)(const char *name, const char *value);	/* value NULL unsets */
+};
+
+typedef int tsh_builtin_fn(int argc, char **argv, const struct tsh_builtin_api *api);
+
+void tsh_init(struct tsh_ctx *c);
+int tsh_eval(struct tsh_ctx *c, const char *cmdline, struct tsh_result *res);
+void tsh_events(struct tsh_ctx *c);	/* also runs pending traps */
+
+#endif /* TSH_H */